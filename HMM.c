@@ -3,13 +3,25 @@
  * @brief Source file containing a custom heap memory allocator implementation.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <stddef.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <errno.h>
+#include <malloc.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "HMM.h"
 
 /**
  * @struct mem_chunk_t
@@ -18,526 +30,4945 @@
 
 typedef struct mem_chunk
 {
-    /**< Flag indicating whether the memory chunk added to hash table or not. */ 
-    unsigned char is_added;
-    /**< Flag indicating whether the memory chunk is free or allocated. */   
-    unsigned char is_free;       
-    /**< Size of the memory chunk (excluding the metadata). */    
+    /**< Size of the physically previous chunk, only valid while that chunk is free (its boundary tag). */
+    size_t prev_size;
+    /**< Size of the memory chunk (excluding the metadata), with the chunk flags in its low bits. */    
     size_t size; 
-    /**< Pointer to the previous memory chunk in the linked list. */                    
-    struct mem_chunk *prev;
-    /**< Pointer to the next memory chunk in the linked list. */
-    struct mem_chunk *next;
-    /**< Pointer to the next free memory chunk with the same size in the hash table. */          
+    /**< Free chunks only: next free memory chunk in the same size-class bin (lives in the payload). */          
     struct mem_chunk *next_free;     
+    /**< Free chunks only: previous free memory chunk in the same size-class bin (lives in the payload). */
+    struct mem_chunk *prev_free;
 } mem_chunk_t;
-/**< Alignment requirement for memory allocation. */
-#define ALIGNMENT 8
- /**< Size of the allocated memory block in sbrk call. */                                 
-#define ALLOCATED_BYTES (8 * 1024 * 1024)  
-/**< Maximum number of solts for hash table */        
-#define MULTIPLES_MAX (ALLOCATED_BYTES / ALIGNMENT) 
+/**
+ * @struct tree_chunk_t
+ * @brief Layout of a free chunk of at least TREE_MIN_SIZE bytes, a node of its arena's best-fit tree.
+ */
+
+typedef struct tree_chunk
+{
+    /**< Same as mem_chunk_t. */
+    size_t prev_size;
+    /**< Same as mem_chunk_t. */
+    size_t size;
+    /**< Subtree of chunks ordered before this one. */
+    struct tree_chunk *left;
+    /**< Subtree of chunks ordered after this one. */
+    struct tree_chunk *right;
+    /**< Parent node, NULL for the root. */
+    struct tree_chunk *parent;
+    /**< 1 for a red node, 0 for a black one. */
+    size_t red;
+    /**< Value of scavenger_epoch when the chunk entered the tree, to tell how long it has been free. */
+    size_t freed_epoch;
+} tree_chunk_t;
+/**< Metadata in front of every payload: prev_size and size. */
+#define CHUNK_HEADER_SIZE offsetof(mem_chunk_t, next_free)
+/**< Smallest payload, large enough to hold the free-list links once the chunk is freed. */
+#define MIN_PAYLOAD_SIZE (sizeof(mem_chunk_t) - CHUNK_HEADER_SIZE)
+/**< Size flag: the chunk is free. */
+#define CHUNK_FREE 0x1
+/**< Size flag: the physically previous chunk is free and prev_size holds its size. */
+#define PREV_FREE 0x2
+/**< Size flag: the payload is zero past its first ZEROED_DIRTY_SIZE bytes, where free-list or tree links may live. */
+#define CHUNK_ZEROED 0x4
+/**< Leading payload bytes of a zeroed chunk that may hold links and still need clearing. */
+#define ZEROED_DIRTY_SIZE (sizeof(tree_chunk_t) - CHUNK_HEADER_SIZE)
+/**< Mask of the flag bits kept in the low bits of size. */
+#define CHUNK_FLAGS ((size_t)ALIGNMENT - 1)
+/**< Alignment of every block handed out, that of max_align_t. */
+#define ALIGNMENT 16
+/**< log2 of ALIGNMENT. */
+#define ALIGNMENT_SHIFT 4
+/**< Default granularity by which segments are mapped, grown and trimmed (grow_bytes, trim_threshold). */
+#define ALLOCATED_BYTES (8 * 1024 * 1024)
+/**< log2 of the number of sub-buckets each logarithmic size class is split into. */
+#define SL_SHIFT 3
+/**< Number of sub-buckets per size class. */
+#define SL_COUNT (1 << SL_SHIFT)
+/**< Sizes below (1 << FL_SHIFT) share size class 0, one sub-bucket per ALIGNMENT step. */
+#define FL_SHIFT (ALIGNMENT_SHIFT + SL_SHIFT)
+/**< Number of logarithmic size classes, enough to index any size_t. */
+#define FL_COUNT (64 - FL_SHIFT + 1)
+/**< Free chunks of at least this size are kept in the best-fit tree instead of the bins. */
+#define TREE_MIN_SIZE (64 * 1024)
+
+/**< Largest payload size served from the per-thread caches. */
+#define TCACHE_MAX_SIZE 1024
+/**< Number of per-thread cache bins, one per ALIGNMENT step up to TCACHE_MAX_SIZE. */
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT)
+/**< Default number of blocks a per-thread cache bin may hold. */
+#define TCACHE_COUNT 32
+/**< Upper bound on the capacity of a per-thread cache bin, set by the width of its count. */
+#define TCACHE_COUNT_LIMIT USHRT_MAX
+
+/**
+ * @struct tcache_entry_t
+ * @brief Link stored in the payload of a block held in a per-thread cache or a remote-free stack.
+ */
+
+typedef struct tcache_entry
+{
+    /**< Next block of the same bin or stack. */
+    struct tcache_entry *next;
+    /**< Points to the owning cache or stack while the block is held there, to catch double frees. */
+    void *key;
+} tcache_entry_t;
+
+/**
+ * @struct tcache_t
+ * @brief Per-thread cache of recently freed blocks, one singly linked list per size.
+ */
+
+typedef struct tcache
+{
+    /**< State of the cache: TCACHE_UNINIT, TCACHE_ACTIVE or TCACHE_DISABLED. */
+    unsigned char state;
+    /**< Number of blocks held by each bin. */
+    unsigned short counts[TCACHE_BINS];
+    /**< Cached blocks of each bin. */
+    tcache_entry_t *entries[TCACHE_BINS];
+} tcache_t;
+/**< The thread has not used its cache yet. */
+#define TCACHE_UNINIT 0
+/**< The cache is registered for flushing at thread exit and can be used. */
+#define TCACHE_ACTIVE 1
+/**< The thread is exiting (or registration failed): bypass the cache. */
+#define TCACHE_DISABLED 2
+
+/**< Capacity of each per-thread cache bin; refills and flushes move half of it at once. */
+
+static size_t tcache_count = TCACHE_COUNT;
+
+/**< Set once tcache_key has been created, so threads can register their cache for flushing. */
+
+static int tcache_keyed;
+
+/**< Per-thread cache, used without taking alloc_mutex. */
+
+static __thread tcache_t tcache __attribute__((tls_model("initial-exec")));
+
+/**< Key whose destructor flushes a thread's cache when the thread exits. */
+
+static pthread_key_t tcache_key;
+
+/**< Guards the creation of tcache_key. */
+
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/**< Per-thread counters, indexes into hmm_thread_stats_t.counters. */
+#define STAT_MALLOC_CALLS 0
+#define STAT_FREE_CALLS 1
+#define STAT_CALLOC_CALLS 2
+#define STAT_REALLOC_CALLS 3
+#define STAT_TCACHE_HITS 4
+#define STAT_MMAP_CALLS 5
+#define STAT_MUNMAP_CALLS 6
+#define STAT_MPROTECT_CALLS 7
+#define STAT_MREMAP_CALLS 8
+#define STAT_TRIM_EVENTS 9
+#define STAT_TRIMMED_BYTES 10
+#define STAT_LOCK_ACQUISITIONS 11
+#define STAT_LOCK_CONTENTIONS 12
+/**< Blocks with their own mapping: +1 when mapped, -1 when unmapped, so the sum over threads is the live count. */
+#define STAT_MMAP_CHUNKS 13
+/**< Bytes of those mappings, kept the same way. */
+#define STAT_MMAP_BYTES 14
+/**< madvise calls dropping the pages of free memory that stays mapped. */
+#define STAT_MADVISE_CALLS 15
+/**< Bytes dropped that way by the scavenger. */
+#define STAT_PURGED_BYTES 16
+/**< Number of per-thread counters. */
+#define STAT_COUNT 17
+
+/**
+ * @struct hmm_thread_stats_t
+ * @brief Counters of one thread, only ever written by that thread.
+ *
+ * Each thread updates its own copy with plain loads and stores, so counting never
+ * bounces a shared cache line; hmm_stats sums the copies of the registered threads
+ * with the totals left by the threads that exited.
+ */
+
+typedef struct hmm_thread_stats
+{
+    /**< Counter values, indexed by the STAT_ constants. */
+    size_t counters[STAT_COUNT];
+    /**< Next registered thread. */
+    struct hmm_thread_stats *next;
+    /**< Previous registered thread. */
+    struct hmm_thread_stats *prev;
+    /**< STATS_UNREGISTERED, STATS_REGISTERED or STATS_RETIRED. */
+    unsigned char state;
+} hmm_thread_stats_t;
+/**< The thread has not counted anything yet. */
+#define STATS_UNREGISTERED 0
+/**< The thread's counters are linked into stats_threads. */
+#define STATS_REGISTERED 1
+/**< The thread is exiting (or registration failed): counters go straight to stats_retired. */
+#define STATS_RETIRED 2
+
+/**< Counters of the calling thread. */
+
+static __thread hmm_thread_stats_t thread_stats __attribute__((tls_model("initial-exec")));
+
+/**< Counters of the threads that are running, linked through thread_stats. */
+
+static hmm_thread_stats_t *stats_threads;
+
+/**< Counters left by threads that exited, updated atomically. */
+
+static size_t stats_retired[STAT_COUNT];
+
+/**< Mutex protecting stats_threads. */
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**< Key whose destructor retires a thread's counters when the thread exits. */
+
+static pthread_key_t stats_key;
+
+/**< Guards the creation of stats_key; stats_key_ready is set once it exists. */
+
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static int stats_key_ready;
+
+/**< Deepest call stack recorded for a sampled allocation. */
+#define PROFILE_DEPTH 32
+/**< Call stack frames inside the allocator (the profiler and the malloc wrapper), left out of samples. */
+#define PROFILE_SKIP 2
+/**< Number of buckets of each profiler hash table (a power of two). */
+#define PROFILE_TABLE_SIZE 4096
+/**< Size of the mappings profiler records are carved from. */
+#define PROFILE_POOL_SIZE (1024 * 1024)
+
+/**
+ * @struct hmm_profile_bucket_t
+ * @brief Allocation and free totals of the sampled blocks allocated from one call stack.
+ */
+
+typedef struct hmm_profile_bucket
+{
+    /**< Next bucket with the same hash table index. */
+    struct hmm_profile_bucket *next;
+    /**< Hash of the call stack. */
+    uint64_t hash;
+    /**< Number of frames in stack. */
+    size_t depth;
+    /**< Return addresses, innermost first. */
+    void *stack[PROFILE_DEPTH];
+    /**< Sampled allocations from this stack. */
+    size_t allocs;
+    /**< Bytes requested by those allocations. */
+    size_t alloc_bytes;
+    /**< Sampled allocations from this stack that were freed. */
+    size_t frees;
+    /**< Bytes of those freed allocations. */
+    size_t free_bytes;
+} hmm_profile_bucket_t;
+
+/**
+ * @struct hmm_profile_sample_t
+ * @brief A sampled block, tracked until it is freed.
+ */
+
+typedef struct hmm_profile_sample
+{
+    /**< Next sample with the same hash table index, or next free record. */
+    struct hmm_profile_sample *next;
+    /**< Address of the block. */
+    void *ptr;
+    /**< Size requested for the block. */
+    size_t size;
+    /**< Bucket of the call stack that allocated the block. */
+    hmm_profile_bucket_t *bucket;
+} hmm_profile_sample_t;
+
+/**
+ * @struct hmm_sampler_t
+ * @brief Per-thread state deciding which allocations are sampled.
+ */
+
+typedef struct hmm_sampler
+{
+    /**< Bytes left to allocate before the next sample; 0 until the first interval is drawn. */
+    int64_t countdown;
+    /**< State of the thread's xorshift random number generator. */
+    uint64_t rng;
+    /**< Set while the thread runs the profiler, so the allocations it makes are not sampled. */
+    unsigned char busy;
+} hmm_sampler_t;
+
+/**< Mean number of bytes between two samples, 0 while sampling is off. */
+
+static size_t sample_interval;
+
+/**< Sampling interval of the recorded samples, written in the profile header. */
+
+static size_t profile_period;
+
+/**< Number of tracked samples; free only looks a block up while it is non-zero. */
+
+static size_t profile_live;
+
+/**< Sampled blocks that are still allocated, hashed by address. */
+
+static hmm_profile_sample_t *profile_samples[PROFILE_TABLE_SIZE];
+
+/**< Buckets of every call stack sampled so far, hashed by stack. */
+
+static hmm_profile_bucket_t *profile_buckets[PROFILE_TABLE_SIZE];
+
+/**< Sample records of freed blocks, reused before carving new ones. */
+
+static hmm_profile_sample_t *profile_free_samples;
+
+/**< Unused part of the current profiler mapping. */
+
+static unsigned char *profile_pool;
+
+/**< Bytes left at profile_pool. */
+
+static size_t profile_pool_left;
+
+/**< Mutex protecting the profiler tables and pool. */
+
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**< Sampling state of the calling thread. */
+
+static __thread hmm_sampler_t sampler __attribute__((tls_model("initial-exec")));
+
+/**< Number of pending remote frees after which the freeing thread tries to drain them itself. */
+#define REMOTE_FREE_BATCH 256
+/**< Default size from which allocations get their own mapping instead of heap chunks. */
+#define MMAP_THRESHOLD (1024 * 1024)
+/**< Upper bound on the number of arenas, whatever the CPU count. */
+#define ARENA_LIMIT 64
+/**< Arenas created per online CPU. */
+#define ARENAS_PER_CPU 4
+/**< Upper bound on the NUMA node numbers the arenas are spread over. */
+#define NUMA_MAX_NODES 64
+/**< Memory policy of mbind: allocate on the given node, falling back to others when it is full. */
+#define HMM_MPOL_PREFERRED 1
+/**< Size and alignment of the mmap'd segments backing every arena. */
+#define SEGMENT_MAX_SIZE (64 * 1024 * 1024)
+/**< Largest alignment served: a payload aligned to SEGMENT_MAX_SIZE would start past its segment header. */
+#define MAX_ALIGNMENT (SEGMENT_MAX_SIZE / 2)
+/**< Segment kind: chunks of an arena, closed by a fencepost. */
+#define SEGMENT_HEAP 0
+/**< Segment kind: slabs of an arena. */
+#define SEGMENT_SLAB 1
+/**< Segment kind: a single chunk with its own mapping, owned by no arena. */
+#define SEGMENT_MMAP 2
+/**< Largest payload size served from slabs instead of chunks. */
+#define SLAB_MAX_SIZE 256
+/**< Size and alignment of a slab: a page-sized run of objects of one size. */
+#define SLAB_SIZE 4096
+/**< Number of slab classes, one per ALIGNMENT step from MIN_PAYLOAD_SIZE to SLAB_MAX_SIZE. */
+#define SLAB_CLASSES ((SLAB_MAX_SIZE - MIN_PAYLOAD_SIZE) / ALIGNMENT + 1)
+/**< Number of 64-bit words in a slab's free bitmap, enough for the smallest objects. */
+#define SLAB_MAP_WORDS (SLAB_SIZE / MIN_PAYLOAD_SIZE / 64)
+
+/**
+ * @struct hmm_slab_t
+ * @brief Header of a slab, found by masking the address of any of its objects.
+ *
+ * Objects carry no header of their own: their size comes from this header.
+ */
+
+typedef struct hmm_slab
+{
+    /**< Next slab in the partial list of its class, or in the arena's empty list. */
+    struct hmm_slab *next;
+    /**< Previous slab in the partial list of its class, or in the arena's empty list. */
+    struct hmm_slab *prev;
+    /**< Size of each object of the slab. */
+    uint32_t object_size;
+    /**< Number of objects handed out, including those held in per-thread caches. */
+    uint32_t used;
+    /**< Number of objects the slab holds. */
+    uint32_t capacity;
+    /**< Low bits of scavenger_epoch when the slab joined the empty list. */
+    uint32_t freed_epoch;
+    /**< Bit i is set while object i is free. */
+    uint64_t free_map[SLAB_MAP_WORDS];
+} hmm_slab_t;
+/**< Offset of the first object inside a slab. */
+#define SLAB_HEADER_SIZE ((sizeof(hmm_slab_t) + ALIGNMENT - 1) & ~((size_t)ALIGNMENT - 1))
+
+/**
+ * @struct hmm_arena_t
+ * @brief An independent heap: its own chunks, free bins and lock.
+ */
+
+typedef struct hmm_arena
+{
+    /**< Mutex protecting everything below. */
+    pthread_mutex_t alloc_mutex;
+    /**< Position of the arena in the arenas array. */
+    size_t index;
+    /**< Segregated free lists: bin [fl][sl] holds free blocks of class fl, sub-bucket sl. */
+    mem_chunk_t *free_bins[FL_COUNT][SL_COUNT];
+    /**< Bit fl is set when size class fl has at least one non-empty sub-bucket. */
+    uint64_t fl_bitmap;
+    /**< Bit sl of sl_bitmap[fl] is set when free_bins[fl][sl] is non-empty. */
+    uint32_t sl_bitmap[FL_COUNT];
+    /**< Red-black tree of the free chunks of at least TREE_MIN_SIZE bytes, ordered by size, then address. */
+    tree_chunk_t *tree_root;
+    /**< Newest segment of the arena, the only one grown in place; NULL until the first allocation. */
+    struct hmm_segment *segments;
+    /**< Slabs of each slab class with at least one free object. */
+    hmm_slab_t *slab_partial[SLAB_CLASSES];
+    /**< Slabs without any object handed out and not purged, reusable by any class. */
+    hmm_slab_t *slab_empty;
+    /**< Newest slab segment, the one new slabs are carved from. */
+    struct hmm_segment *slab_segments;
+    /**< Current free memory size. */
+    size_t current_free_size;
+    /**< Blocks freed by threads bound to other arenas: a lock-free stack pushed by any thread, drained under alloc_mutex. */
+    tcache_entry_t *remote_frees;
+    /**< Approximate number of blocks in remote_frees. */
+    size_t remote_count;
+    /**< NUMA node the arena's memory is bound to; only meaningful when numa_nodes > 1. */
+    int node;
+} hmm_arena_t;
+
+/**
+ * @struct hmm_segment_t
+ * @brief Header of a SEGMENT_MAX_SIZE-aligned mapping.
+ *
+ * A heap segment starts with its first chunk right after this header and ends with its
+ * own fencepost, so segments never depend on each other's placement. A slab segment is
+ * carved into slabs, and an mmap segment holds one large chunk. Aligning the mapping
+ * lets the kind and owner of any block inside it be found by masking the block address.
+ */
+
+typedef struct hmm_segment
+{
+    /**< Arena owning the blocks of this segment, NULL for an mmap segment. */
+    hmm_arena_t *arena;
+    /**< SEGMENT_HEAP, SEGMENT_SLAB or SEGMENT_MMAP. */
+    size_t kind;
+    /**< Newer segment of the same arena, NULL for the newest one. */
+    struct hmm_segment *prev;
+    /**< Older segment of the same arena. */
+    struct hmm_segment *next;
+    /**< Bytes of the reservation that are currently mapped read/write. */
+    size_t size;
+    /**< Heap segments: fencepost chunk (size 0, never free) closing the segment. */
+    mem_chunk_t *tail;
+    /**< Slab segments: bytes from the start of the segment already carved into slabs. */
+    size_t carved;
+    /**< Heap segments: offset up to which the memory past the fencepost may not be zero, after a trim that left it as it was. */
+    size_t dirty_end;
+    /**< Slab segments: carved slabs without any object handed out, on the empty list or purged. */
+    size_t slabs_free;
+    /**< Slab segments: slabs whose pages were given back, flagged in the bitmap of HMMslab_purged_map. */
+    size_t slabs_purged;
+} hmm_segment_t;
+/**< Offset of the first chunk inside a segment. */
+#define SEGMENT_HEADER_SIZE ((sizeof(hmm_segment_t) + ALIGNMENT - 1) & ~((size_t)ALIGNMENT - 1))
+
+/**< Requests of at least this many bytes are served by HMMmmap_alloc. */
+
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+/**< Step by which segments are made writable: a power of two from HUGE_PAGE_SIZE to SEGMENT_MAX_SIZE. */
+
+static size_t grow_bytes = ALLOCATED_BYTES;
+
+/**< Free bytes at the end of a segment (and in its arena) from which free gives them back to the system. */
+
+static size_t trim_threshold = ALLOCATED_BYTES;
+
+/**< Makes HMMtunables_load run once, before the first allocation of any thread. */
+
+static pthread_once_t tunables_once = PTHREAD_ONCE_INIT;
+
+/**< Size and alignment of a transparent huge page. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**< Set while heap memory is backed by transparent huge pages (hmm_set_huge_pages). */
+
+static int huge_pages;
+
+/**< Scavenger ticks per decay time: a chunk is returned once it has stayed free for that many ticks. */
+#define DECAY_STEPS 4
+
+/**< Decay time in milliseconds while the scavenger thread runs; 0 when it does not and free trims inline. */
+
+static size_t decay_ms;
+
+/**< Scavenger ticks elapsed so far, the clock free tree chunks are stamped with. */
+
+static size_t scavenger_epoch;
+
+/**< Set to ask the scavenger thread to exit. */
+
+static int scavenger_stopping;
+
+/**< Scavenger thread, valid while decay_ms is non-zero. */
+
+static pthread_t scavenger_thread;
+
+/**< Mutex protecting the scavenger state, and the condition the scavenger sleeps on between ticks. */
+
+static pthread_mutex_t scavenger_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t scavenger_cond;
+
+/**< Set once scavenger_cond has been initialized to use the monotonic clock. */
+
+static int scavenger_cond_ready;
+
+/**< Main arena, statically allocated so it exists before any other. */
+
+static hmm_arena_t main_arena = {.alloc_mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**< Arenas created so far; arenas[0] is the main arena. */
+
+static hmm_arena_t *arenas[ARENA_LIMIT] = {&main_arena};
+
+/**< Number of entries used in arenas. */
+
+static size_t arena_count = 1;
+
+/**< Maximum number of arenas, computed from the CPU count on first use. */
 
-/**< Array of linked lists containing free memory blocks based on size. (Hash table) */
+static size_t arena_max;
 
-static mem_chunk_t *block_freq[MULTIPLES_MAX];  
+/**< Round-robin counter used to bind new threads to arenas. */
 
-/**< Mutex for thread safety. */
+static size_t arena_next;
 
-static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER; 
+/**< Number of online NUMA nodes, computed with arena_max; arenas are per node only when it exceeds 1. */
 
-/**< Pointer to the head of the memory chunk linked list. */
+static size_t numa_nodes;
 
-static mem_chunk_t *head; 
+/**< Highest online NUMA node number. */
 
-/**< Pointer to the tail of the memory chunk linked list. */
+static size_t numa_max_node;
 
-static mem_chunk_t *tail; 
+/**< Per-node round-robin counters used to bind new threads to the arenas of their node. */
 
-/**< Current free memory size. */
+static size_t numa_next[NUMA_MAX_NODES];
 
-static size_t current_free_size; 
+/**< Mutex protecting arena creation and thread-to-arena assignment. */
 
+static pthread_mutex_t arenas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**< Arena the calling thread allocates from. */
+
+static __thread hmm_arena_t *thread_arena __attribute__((tls_model("initial-exec")));
+
+/**
+ * @brief Folds the calling thread's counters into stats_retired and unlinks them.
+ * 
+ * Called as the stats_key destructor when a thread exits.
+ * 
+ * @param arg Unused.
+ */
+static void HMMstats_retire(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&stats_mutex);
+    for (size_t i = 0; i < STAT_COUNT; i++)
+    {
+        __atomic_fetch_add(&stats_retired[i], thread_stats.counters[i], __ATOMIC_RELAXED);
+    }
+    if (thread_stats.prev)
+    {
+        thread_stats.prev->next = thread_stats.next;
+    }
+    else
+    {
+        stats_threads = thread_stats.next;
+    }
+    if (thread_stats.next)
+    {
+        thread_stats.next->prev = thread_stats.prev;
+    }
+    thread_stats.state = STATS_RETIRED;
+    pthread_mutex_unlock(&stats_mutex);
+}
+/**
+ * @brief Creates the key used to retire per-thread counters at thread exit.
+ */
+static void HMMstats_key_init(void)
+{
+    stats_key_ready = (pthread_key_create(&stats_key, HMMstats_retire) == 0);
+}
+/**
+ * @brief Links the calling thread's counters into stats_threads.
+ * 
+ * The thread counts into stats_retired while registering, since pthread_setspecific
+ * may allocate and so count on its own.
+ */
+static void HMMstats_register(void)
+{
+    thread_stats.state = STATS_RETIRED;
+    pthread_once(&stats_key_once, HMMstats_key_init);
+    if (stats_key_ready && (pthread_setspecific(stats_key, &thread_stats) == 0))
+    {
+        pthread_mutex_lock(&stats_mutex);
+        thread_stats.prev = NULL;
+        thread_stats.next = stats_threads;
+        if (stats_threads)
+        {
+            stats_threads->prev = &thread_stats;
+        }
+        stats_threads = &thread_stats;
+        thread_stats.state = STATS_REGISTERED;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+}
+/**
+ * @brief Adds a value to one of the calling thread's counters.
+ * 
+ * The counter is only written by this thread, so a relaxed load and store is
+ * enough: no locked instruction, no shared cache line.
+ * 
+ * @param counter Index of the counter (a STAT_ constant).
+ * @param value Value to add; deltas are added as their two's complement.
+ */
+static void HMMstat_add(size_t counter, size_t value)
+{
+    if (thread_stats.state != STATS_REGISTERED)
+    {
+        if (thread_stats.state == STATS_UNREGISTERED)
+        {
+            HMMstats_register();
+        }
+        if (thread_stats.state == STATS_RETIRED)
+        {
+            __atomic_fetch_add(&stats_retired[counter], value, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    size_t *slot = &thread_stats.counters[counter];
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+/**
+ * @brief Returns the size of a chunk without its flag bits.
+ * 
+ * @param chunk Pointer to the chunk.
+ * @return Payload size of the chunk.
+ */
+static size_t HMMchunk_size(mem_chunk_t *chunk)
+{
+    return chunk->size & ~CHUNK_FLAGS;
+}
+/**
+ * @brief Sets the size of a chunk, keeping its flag bits.
+ * 
+ * @param chunk Pointer to the chunk.
+ * @param size New payload size (multiple of ALIGNMENT).
+ */
+static void HMMset_chunk_size(mem_chunk_t *chunk, size_t size)
+{
+    chunk->size = size | (chunk->size & CHUNK_FLAGS);
+}
+/**
+ * @brief Returns the chunk owning a payload pointer.
+ * 
+ * @param ptr Pointer returned by HMMmalloc.
+ * @return Pointer to the chunk header.
+ */
+static mem_chunk_t *HMMpayload_chunk(void *ptr)
+{
+    return (mem_chunk_t *)((unsigned char *)ptr - CHUNK_HEADER_SIZE);
+}
+/**
+ * @brief Returns the chunk physically following a given chunk.
+ * 
+ * @param chunk Pointer to a chunk other than the fencepost.
+ * @return Pointer to the next chunk (the fencepost for the last chunk).
+ */
+static mem_chunk_t *HMMnext_chunk(mem_chunk_t *chunk)
+{
+    return (mem_chunk_t *)((unsigned char *)chunk + CHUNK_HEADER_SIZE + HMMchunk_size(chunk));
+}
+/**
+ * @brief Returns the free chunk physically preceding a given chunk, using its boundary tag.
+ * 
+ * @param chunk Pointer to a chunk with the PREV_FREE flag set.
+ * @return Pointer to the previous chunk.
+ */
+static mem_chunk_t *HMMprev_chunk(mem_chunk_t *chunk)
+{
+    return (mem_chunk_t *)((unsigned char *)chunk - chunk->prev_size - CHUNK_HEADER_SIZE);
+}
+/**
+ * @brief Marks a chunk as free and writes its boundary tag into the next chunk.
+ * 
+ * @param chunk Pointer to the chunk to be marked.
+ */
+static void HMMset_free(mem_chunk_t *chunk)
+{
+    mem_chunk_t *next = HMMnext_chunk(chunk);
+    chunk->size |= CHUNK_FREE;
+    next->prev_size = HMMchunk_size(chunk);
+    next->size |= PREV_FREE;
+}
+/**
+ * @brief Marks a chunk as allocated.
+ * 
+ * @param chunk Pointer to the chunk to be marked.
+ */
+static void HMMset_in_use(mem_chunk_t *chunk)
+{
+    chunk->size &= ~(size_t)CHUNK_FREE;
+    HMMnext_chunk(chunk)->size &= ~(size_t)PREV_FREE;
+}
+/**
+ * @brief Maps a block size to its size class and sub-bucket.
+ * 
+ * @param size Block size (multiple of ALIGNMENT).
+ * @param fl Output: logarithmic size class.
+ * @param sl Output: sub-bucket inside the size class.
+ */
+static void HMMmapping(size_t size, size_t *fl, size_t *sl)
+{
+    if (size < ((size_t)1 << FL_SHIFT))
+    {
+        // Small sizes: class 0, one sub-bucket per ALIGNMENT step.
+        *fl = 0;
+        *sl = size >> ALIGNMENT_SHIFT;
+    }
+    else
+    {
+        size_t msb = 63 - __builtin_clzl(size);
+        *fl = msb - FL_SHIFT + 1;
+        *sl = (size >> (msb - SL_SHIFT)) & (SL_COUNT - 1);
+    }
+}
+/**
+ * @brief Returns the size of a tree node's chunk without its flag bits.
+ * 
+ * @param node Pointer to the node.
+ * @return Payload size of the chunk.
+ */
+static size_t HMMtree_size(tree_chunk_t *node)
+{
+    return HMMchunk_size((mem_chunk_t *)node);
+}
+/**
+ * @brief Orders tree nodes by size, breaking ties by address.
+ * 
+ * @param a First node.
+ * @param b Second node.
+ * @return 1 if a comes before b, 0 otherwise.
+ */
+static int HMMtree_less(tree_chunk_t *a, tree_chunk_t *b)
+{
+    return (HMMtree_size(a) < HMMtree_size(b)) || ((HMMtree_size(a) == HMMtree_size(b)) && (a < b));
+}
+/**
+ * @brief Replaces the subtree rooted at a node with another subtree in the node's parent.
+ * 
+ * @param arena Arena owning the tree.
+ * @param old_node Node being replaced.
+ * @param new_node Replacement, possibly NULL.
+ */
+static void HMMtree_replace(hmm_arena_t *arena, tree_chunk_t *old_node, tree_chunk_t *new_node)
+{
+    if (old_node->parent == NULL)
+    {
+        arena->tree_root = new_node;
+    }
+    else if (old_node == old_node->parent->left)
+    {
+        old_node->parent->left = new_node;
+    }
+    else
+    {
+        old_node->parent->right = new_node;
+    }
+    if (new_node)
+    {
+        new_node->parent = old_node->parent;
+    }
+}
+/**
+ * @brief Rotates a node down to the left: its right child takes its place.
+ * 
+ * @param arena Arena owning the tree.
+ * @param node Node with a right child.
+ */
+static void HMMtree_rotate_left(hmm_arena_t *arena, tree_chunk_t *node)
+{
+    tree_chunk_t *child = node->right;
+    node->right = child->left;
+    if (child->left)
+    {
+        child->left->parent = node;
+    }
+    HMMtree_replace(arena, node, child);
+    child->left = node;
+    node->parent = child;
+}
+/**
+ * @brief Rotates a node down to the right: its left child takes its place.
+ * 
+ * @param arena Arena owning the tree.
+ * @param node Node with a left child.
+ */
+static void HMMtree_rotate_right(hmm_arena_t *arena, tree_chunk_t *node)
+{
+    tree_chunk_t *child = node->left;
+    node->left = child->right;
+    if (child->right)
+    {
+        child->right->parent = node;
+    }
+    HMMtree_replace(arena, node, child);
+    child->right = node;
+    node->parent = child;
+}
+/**
+ * @brief Inserts a free chunk into the best-fit tree and rebalances it.
+ * 
+ * @param arena Arena owning the tree.
+ * @param node Free chunk of at least TREE_MIN_SIZE bytes.
+ */
+static void HMMtree_insert(hmm_arena_t *arena, tree_chunk_t *node)
+{
+    tree_chunk_t *parent = NULL;
+    tree_chunk_t **link = &arena->tree_root;
+    while (*link)
+    {
+        parent = *link;
+        link = HMMtree_less(node, parent) ? &parent->left : &parent->right;
+    }
+    node->left = node->right = NULL;
+    node->parent = parent;
+    node->red = 1;
+    node->freed_epoch = __atomic_load_n(&scavenger_epoch, __ATOMIC_RELAXED);
+    *link = node;
+        // Restore the red-black properties on the way up.
+
+    while (node->parent && node->parent->red)
+    {
+        parent = node->parent;
+        tree_chunk_t *grandparent = parent->parent;
+        tree_chunk_t *uncle = (parent == grandparent->left) ? grandparent->right : grandparent->left;
+        if (uncle && uncle->red)
+        {
+            parent->red = 0;
+            uncle->red = 0;
+            grandparent->red = 1;
+            node = grandparent;
+        }
+        else if (parent == grandparent->left)
+        {
+            if (node == parent->right)
+            {
+                HMMtree_rotate_left(arena, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            grandparent->red = 1;
+            HMMtree_rotate_right(arena, grandparent);
+        }
+        else
+        {
+            if (node == parent->left)
+            {
+                HMMtree_rotate_right(arena, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            grandparent->red = 1;
+            HMMtree_rotate_left(arena, grandparent);
+        }
+    }
+    arena->tree_root->red = 0;
+}
+/**
+ * @brief Removes a free chunk from the best-fit tree and rebalances it.
+ * 
+ * @param arena Arena owning the tree.
+ * @param node Chunk currently in the tree.
+ */
+static void HMMtree_remove(hmm_arena_t *arena, tree_chunk_t *node)
+{
+    tree_chunk_t *child, *parent;
+    size_t removed_red = node->red;
+    if (node->left == NULL)
+    {
+        child = node->right;
+        parent = node->parent;
+        HMMtree_replace(arena, node, child);
+    }
+    else if (node->right == NULL)
+    {
+        child = node->left;
+        parent = node->parent;
+        HMMtree_replace(arena, node, child);
+    }
+    else
+    {
+        // Move the successor into the node's place.
+
+        tree_chunk_t *successor = node->right;
+        while (successor->left)
+        {
+            successor = successor->left;
+        }
+        removed_red = successor->red;
+        child = successor->right;
+        if (successor->parent == node)
+        {
+            parent = successor;
+        }
+        else
+        {
+            parent = successor->parent;
+            HMMtree_replace(arena, successor, successor->right);
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+        HMMtree_replace(arena, node, successor);
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->red = node->red;
+    }
+    if (removed_red)
+    {
+        return;
+    }
+        // A black node was removed: push the missing black up or rotate it in from the sibling.
+
+    while ((child != arena->tree_root) && ((child == NULL) || !child->red))
+    {
+        if (child == parent->left)
+        {
+            tree_chunk_t *sibling = parent->right;
+            if (sibling->red)
+            {
+                sibling->red = 0;
+                parent->red = 1;
+                HMMtree_rotate_left(arena, parent);
+                sibling = parent->right;
+            }
+            if ((sibling->left == NULL || !sibling->left->red) && (sibling->right == NULL || !sibling->right->red))
+            {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+            }
+            else
+            {
+                if (sibling->right == NULL || !sibling->right->red)
+                {
+                    sibling->left->red = 0;
+                    sibling->red = 1;
+                    HMMtree_rotate_right(arena, sibling);
+                    sibling = parent->right;
+                }
+                sibling->red = parent->red;
+                parent->red = 0;
+                sibling->right->red = 0;
+                HMMtree_rotate_left(arena, parent);
+                child = arena->tree_root;
+            }
+        }
+        else
+        {
+            tree_chunk_t *sibling = parent->left;
+            if (sibling->red)
+            {
+                sibling->red = 0;
+                parent->red = 1;
+                HMMtree_rotate_right(arena, parent);
+                sibling = parent->left;
+            }
+            if ((sibling->left == NULL || !sibling->left->red) && (sibling->right == NULL || !sibling->right->red))
+            {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+            }
+            else
+            {
+                if (sibling->left == NULL || !sibling->left->red)
+                {
+                    sibling->right->red = 0;
+                    sibling->red = 1;
+                    HMMtree_rotate_left(arena, sibling);
+                    sibling = parent->left;
+                }
+                sibling->red = parent->red;
+                parent->red = 0;
+                sibling->left->red = 0;
+                HMMtree_rotate_right(arena, parent);
+                child = arena->tree_root;
+            }
+        }
+    }
+    if (child)
+    {
+        child->red = 0;
+    }
+}
+/**
+ * @brief Finds the best-fitting chunk of the tree: the smallest one that fits, lowest address first.
+ * 
+ * @param arena Arena owning the tree.
+ * @param size Payload size that must fit.
+ * @return Pointer to the chunk (still in the tree), NULL if none is large enough.
+ */
+static tree_chunk_t *HMMtree_best_fit(hmm_arena_t *arena, size_t size)
+{
+    tree_chunk_t *best = NULL;
+    tree_chunk_t *node = arena->tree_root;
+    while (node)
+    {
+        if (HMMtree_size(node) >= size)
+        {
+            best = node;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return best;
+}
+/**
+ * @brief Removes a free memory block from its size-class bin or from the best-fit tree.
+ * 
+ * @param arena Arena owning the block.
+ * @param block Pointer to the memory block to be removed.
+ */
+static void HMMremove_free_block(hmm_arena_t *arena, mem_chunk_t *block)
+{
+    if (block == NULL)
+        return;
+    arena->current_free_size -= (HMMchunk_size(block) + CHUNK_HEADER_SIZE);
+    if (HMMchunk_size(block) >= TREE_MIN_SIZE)
+    {
+        HMMtree_remove(arena, (tree_chunk_t *)block);
+        return;
+    }
+    size_t fl, sl;
+    HMMmapping(HMMchunk_size(block), &fl, &sl);
+        // Unlink the block through its neighbours in the bin.
+
+    if (block->prev_free)
+    {
+        block->prev_free->next_free = block->next_free;
+    }
+    else
+    {
+        arena->free_bins[fl][sl] = block->next_free;
+    }
+    if (block->next_free)
+    {
+        block->next_free->prev_free = block->prev_free;
+    }
+        // Clear the bitmap bits if the bin became empty.
+
+    if (arena->free_bins[fl][sl] == NULL)
+    {
+        arena->sl_bitmap[fl] &= ~(1U << sl);
+        if (arena->sl_bitmap[fl] == 0)
+            arena->fl_bitmap &= ~((uint64_t)1 << fl);
+    }
+}
+/**
+ * @brief Adds a free memory block to its size-class bin, or to the best-fit tree if it is large.
+ * 
+ * @param arena Arena owning the block.
+ * @param block Pointer to the memory block to be added.
+ */
+static void HMMadd_free_block(hmm_arena_t *arena, mem_chunk_t *block)
+{
+    if (block == NULL)
+        return;
+    arena->current_free_size+=(HMMchunk_size(block) + CHUNK_HEADER_SIZE);
+    if (HMMchunk_size(block) >= TREE_MIN_SIZE)
+    {
+        HMMtree_insert(arena, (tree_chunk_t *)block);
+        return;
+    }
+    size_t fl, sl;
+    HMMmapping(HMMchunk_size(block), &fl, &sl);
+    block->next_free = arena->free_bins[fl][sl];
+    block->prev_free = NULL;
+    if (block->next_free)
+        block->next_free->prev_free = block;
+    arena->free_bins[fl][sl] = block;
+    arena->sl_bitmap[fl] |= 1U << sl;
+    arena->fl_bitmap |= (uint64_t)1 << fl;
+}
+/**
+ * @brief Retrieves a free memory block of at least the specified size from the bins or the tree.
+ * 
+ * The size is rounded up to the next sub-bucket boundary so that any block of the
+ * first non-empty bin found through the bitmaps fits (good-fit in O(1)). If that
+ * fails, the bin holding the exact size is scanned for a block that is large enough,
+ * and then the best-fit tree is searched. Sizes of at least TREE_MIN_SIZE go straight
+ * to the tree (best-fit in O(log n)).
+ * 
+ * @param arena Arena to search.
+ * @param size Size of the memory block to retrieve.
+ * @return Pointer to the free memory block if found, NULL otherwise.
+ */
+static mem_chunk_t *HMMget_free_block(hmm_arena_t *arena, size_t size)
+{
+    if (size >= TREE_MIN_SIZE)
+    {
+        mem_chunk_t *best = (mem_chunk_t *)HMMtree_best_fit(arena, size);
+        HMMremove_free_block(arena, best);
+        return best;
+    }
+    size_t fl, sl;
+    size_t search_size = size;
+    if (size >= ((size_t)1 << FL_SHIFT))
+    {
+        search_size += ((size_t)1 << (63 - __builtin_clzl(size) - SL_SHIFT)) - 1;
+    }
+    HMMmapping(search_size, &fl, &sl);
+        // Look for a non-empty bin at or above (fl, sl).
+
+    uint32_t sl_map = (sl < SL_COUNT) ? (arena->sl_bitmap[fl] & (~0U << sl)) : 0;
+    if (sl_map == 0)
+    {
+        uint64_t fl_map = (fl + 1 < FL_COUNT) ? (arena->fl_bitmap & (~(uint64_t)0 << (fl + 1))) : 0;
+        if (fl_map)
+        {
+            fl = __builtin_ctzl(fl_map);
+            sl_map = arena->sl_bitmap[fl];
+        }
+    }
+    mem_chunk_t *ret = NULL;
+    if (sl_map)
+    {
+        sl = __builtin_ctz(sl_map);
+        ret = arena->free_bins[fl][sl];
+    }
+    else
+    {
+        // No bin is guaranteed to fit, scan the bin of the exact size.
+
+        HMMmapping(size, &fl, &sl);
+        ret = arena->free_bins[fl][sl];
+        while (ret && HMMchunk_size(ret) < size)
+        {
+            ret = ret->next_free;
+        }
+        if (ret == NULL)
+        {
+            // Any chunk of the tree is larger than the request: take the smallest.
+
+            ret = (mem_chunk_t *)HMMtree_best_fit(arena, size);
+        }
+    }
+    HMMremove_free_block(arena, ret);
+    return ret;
+}
+/**
+ * @brief Clears the header of a chunk and the links its payload may hold.
+ * 
+ * Used when a zeroed chunk is absorbed into another zeroed chunk, so that the
+ * merged payload is zero past its own links as well.
+ * 
+ * @param chunk Pointer to the absorbed chunk.
+ */
+static void HMMclear_links(mem_chunk_t *chunk)
+{
+    size_t size = HMMchunk_size(chunk);
+    memset(chunk, 0, CHUNK_HEADER_SIZE + ((size < ZEROED_DIRTY_SIZE) ? size : ZEROED_DIRTY_SIZE));
+}
+/**
+ * @brief Coalesces a block with both of its physical neighbours if they are free.
+ * 
+ * The next chunk is reached through the block size and the previous one through
+ * its boundary tag, so merging costs O(1). Merged neighbours are removed from the bins.
+ * 
+ * @param arena Arena owning the block.
+ * @param block Pointer to the block to coalesce (not in the bins).
+ * @return Pointer to the resulting free block, which is not in the bins either.
+ */
+static mem_chunk_t *HMMcoalesce(hmm_arena_t *arena, mem_chunk_t *block)
+{
+    // The merged block stays zeroed only if every part was; the absorbed header and links are then cleared.
+
+    size_t zeroed = block->size & CHUNK_ZEROED;
+    mem_chunk_t *next = HMMnext_chunk(block);
+    if (next->size & CHUNK_FREE)
+    {
+        HMMremove_free_block(arena, next);
+        size_t next_size = HMMchunk_size(next);
+        zeroed &= next->size;
+        if (zeroed)
+        {
+            HMMclear_links(next);
+        }
+        HMMset_chunk_size(block, HMMchunk_size(block) + next_size + CHUNK_HEADER_SIZE);
+    }
+    if (block->size & PREV_FREE)
+    {
+        mem_chunk_t *prev = HMMprev_chunk(block);
+        HMMremove_free_block(arena, prev);
+        size_t block_size = HMMchunk_size(block);
+        zeroed &= prev->size;
+        if (zeroed)
+        {
+            HMMclear_links(block);
+        }
+        HMMset_chunk_size(prev, HMMchunk_size(prev) + block_size + CHUNK_HEADER_SIZE);
+        block = prev;
+    }
+    block->size = (block->size & ~(size_t)CHUNK_ZEROED) | zeroed;
+    HMMset_free(block);
+    return block;
+}
+/**
+ * @brief Returns the segment containing an address.
+ * 
+ * @param address Pointer to a chunk, a payload or a slab object inside a segment.
+ * @return Pointer to the segment header.
+ */
+static hmm_segment_t *HMMsegment_for_address(void *address)
+{
+    return (hmm_segment_t *)((uintptr_t)address & ~((uintptr_t)SEGMENT_MAX_SIZE - 1));
+}
+/**
+ * @brief Returns the first chunk of a segment.
+ * 
+ * @param segment Pointer to the segment header.
+ * @return Pointer to the chunk following the header.
+ */
+static mem_chunk_t *HMMsegment_first_chunk(hmm_segment_t *segment)
+{
+    return (mem_chunk_t *)((unsigned char *)segment + SEGMENT_HEADER_SIZE);
+}
+/**
+ * @brief Appends the newly mapped end of a segment after its fencepost.
+ * 
+ * The old fencepost becomes the header of a new free chunk (merged with the last
+ * chunk if that one is free) and a new fencepost is written at the new end.
+ * 
+ * @param arena Arena owning the segment.
+ * @param segment Segment whose size was just raised.
+ */
+static void HMMextend_segment(hmm_arena_t *arena, hmm_segment_t *segment)
+{
+    mem_chunk_t *new_chunk = segment->tail;
+    HMMset_chunk_size(new_chunk, (unsigned char *)segment + segment->size - (unsigned char *)new_chunk - 2 * CHUNK_HEADER_SIZE);
+        // Memory past a fencepost is zero, unless the last trim left some of it dirty.
+
+    if ((unsigned char *)segment + segment->dirty_end <= (unsigned char *)new_chunk + CHUNK_HEADER_SIZE + ZEROED_DIRTY_SIZE)
+    {
+        new_chunk->size |= CHUNK_ZEROED;
+    }
+    segment->dirty_end = 0;
+    segment->tail = HMMnext_chunk(new_chunk);
+    segment->tail->size = 0;
+        // Merge with the last chunk if it is free, then make the space available.
+
+    new_chunk = HMMcoalesce(arena, new_chunk);
+    HMMadd_free_block(arena, new_chunk);
+}
+/**
+ * @brief Binds a newly writable range to a NUMA node.
+ * 
+ * The range is bound with MPOL_PREFERRED, so pages still come from another node
+ * once it is full. Ranges are bound again each time they become writable, as
+ * trimming replaces them.
+ * 
+ * @param node NUMA node to bind the range to, -1 to leave it to the default policy.
+ * @param start Start of the range.
+ * @param length Length of the range.
+ */
+static void HMMbind_range(int node, void *start, size_t length)
+{
+    if ((node >= 0) && (numa_nodes > 1))
+    {
+        unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+        mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, start, length, HMM_MPOL_PREFERRED, mask, (unsigned long)NUMA_MAX_NODES + 1, 0);
+    }
+}
+/**
+ * @brief Applies the huge page and NUMA policies to a newly writable range of a segment.
+ * 
+ * Segments are SEGMENT_MAX_SIZE-aligned and grow by grow_bytes, so heap and
+ * slab ranges always start and end on a huge page boundary.
+ * 
+ * @param node NUMA node to bind the range to, -1 to leave it to the default policy.
+ * @param start Start of the range.
+ * @param length Length of the range.
+ */
+static void HMMadvise_range(int node, void *start, size_t length)
+{
+    if (__atomic_load_n(&huge_pages, __ATOMIC_RELAXED) && (length >= HUGE_PAGE_SIZE))
+    {
+        madvise(start, length, MADV_HUGEPAGE);
+        HMMstat_add(STAT_MADVISE_CALLS, 1);
+    }
+    HMMbind_range(node, start, length);
+}
+/**
+ * @brief Returns the granularity memory is given back to the system in.
+ * 
+ * With huge pages, only whole huge pages are released, so trimming never splits one.
+ * 
+ * @return HUGE_PAGE_SIZE with huge pages enabled, the page size otherwise.
+ */
+static size_t HMMrelease_granule(void)
+{
+    return __atomic_load_n(&huge_pages, __ATOMIC_RELAXED) ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+}
+/**
+ * @brief Reserves a SEGMENT_MAX_SIZE-aligned region mapped PROT_NONE.
+ * 
+ * @param length Length of the region.
+ * @return Start of the region, NULL if mapping failed.
+ */
+static unsigned char *HMMreserve_segment(size_t length)
+{
+    if (length > SIZE_MAX - SEGMENT_MAX_SIZE)
+    {
+        return NULL;
+    }
+        // Over-reserve by the alignment and trim both ends.
+
+    unsigned char *region = mmap(NULL, length + SEGMENT_MAX_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    HMMstat_add(STAT_MMAP_CALLS, 1);
+    if (region == MAP_FAILED)
+    {
+        return NULL;
+    }
+    unsigned char *aligned = (unsigned char *)(((uintptr_t)region + SEGMENT_MAX_SIZE - 1) & ~((uintptr_t)SEGMENT_MAX_SIZE - 1));
+    if (aligned > region)
+    {
+        munmap(region, aligned - region);
+        HMMstat_add(STAT_MUNMAP_CALLS, 1);
+    }
+    if (region + length + SEGMENT_MAX_SIZE > aligned + length)
+    {
+        munmap(aligned + length, region + length + SEGMENT_MAX_SIZE - (aligned + length));
+        HMMstat_add(STAT_MUNMAP_CALLS, 1);
+    }
+    return aligned;
+}
+/**
+ * @brief Maps a new segment for an arena, made of one free chunk closed by a fencepost.
+ * 
+ * Segments are SEGMENT_MAX_SIZE-aligned reservations mapped PROT_NONE, of which
+ * only the first size bytes are made readable and writable.
+ * 
+ * @param arena Arena being grown.
+ * @param size Bytes to map read/write, a multiple of grow_bytes.
+ * @return Pointer to the new segment, NULL if mapping failed.
+ */
+static hmm_segment_t *HMMmap_segment(hmm_arena_t *arena, size_t size)
+{
+    unsigned char *aligned = HMMreserve_segment(SEGMENT_MAX_SIZE);
+    if (aligned == NULL)
+    {
+        return NULL;
+    }
+    HMMstat_add(STAT_MPROTECT_CALLS, 1);
+    if (mprotect(aligned, size, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(aligned, SEGMENT_MAX_SIZE);
+        HMMstat_add(STAT_MUNMAP_CALLS, 1);
+        return NULL;
+    }
+    HMMadvise_range(arena->node, aligned, size);
+    hmm_segment_t *segment = (hmm_segment_t *)aligned;
+    segment->arena = arena;
+    segment->kind = SEGMENT_HEAP;
+    segment->prev = NULL;
+    segment->next = arena->segments;
+    segment->size = size;
+    if (arena->segments)
+    {
+        arena->segments->prev = segment;
+    }
+    arena->segments = segment;
+    mem_chunk_t *new_chunk = HMMsegment_first_chunk(segment);
+    new_chunk->size = (size - SEGMENT_HEADER_SIZE - 2 * CHUNK_HEADER_SIZE) | CHUNK_ZEROED;
+    segment->tail = HMMnext_chunk(new_chunk);
+    segment->tail->size = 0;
+    HMMset_free(new_chunk);
+    HMMadd_free_block(arena, new_chunk);
+    return segment;
+}
+/**
+ * @brief Grows a segment inside its reservation so that a chunk of a given size fits after its last chunk.
+ * 
+ * @param arena Arena owning the segment.
+ * @param segment Segment to grow.
+ * @param size Payload size that must fit after the growth.
+ * @return 1 on success, 0 if the reservation is too small or mprotect failed.
+ */
+static int HMMgrow_segment(hmm_arena_t *arena, hmm_segment_t *segment, size_t size)
+{
+    size_t allocation_size = __atomic_load_n(&grow_bytes, __ATOMIC_RELAXED);
+    size_t used = (unsigned char *)segment->tail + CHUNK_HEADER_SIZE - (unsigned char *)segment;
+    size_t new_size = ((used + size + 2 * CHUNK_HEADER_SIZE + allocation_size - 1) / allocation_size) * allocation_size;
+    if (new_size > SEGMENT_MAX_SIZE)
+    {
+        new_size = SEGMENT_MAX_SIZE;
+    }
+    if (new_size < used + size + 2 * CHUNK_HEADER_SIZE)
+    {
+        return 0;
+    }
+    if (new_size > segment->size)
+    {
+        HMMstat_add(STAT_MPROTECT_CALLS, 1);
+        if (mprotect((unsigned char *)segment + segment->size, new_size - segment->size, PROT_READ | PROT_WRITE) != 0)
+        {
+            return 0;
+        }
+        HMMadvise_range(arena->node, (unsigned char *)segment + segment->size, new_size - segment->size);
+        segment->size = new_size;
+    }
+    HMMextend_segment(arena, segment);
+    return 1;
+}
+/**
+ * @brief Grows an arena, first inside its newest segment, then with a new segment.
+ * 
+ * A new segment is sized to the request, rounded up to grow_bytes.
+ * 
+ * @param arena Arena being grown.
+ * @param size Payload size that must fit after the growth.
+ * @return 1 on success, 0 if the request cannot fit in a segment or mapping failed.
+ */
+static int HMMgrow_arena(hmm_arena_t *arena, size_t size)
+{
+    size_t allocation_size = __atomic_load_n(&grow_bytes, __ATOMIC_RELAXED);
+    if (arena->segments && HMMgrow_segment(arena, arena->segments, size))
+    {
+        return 1;
+    }
+    if (SEGMENT_HEADER_SIZE + size + 2 * CHUNK_HEADER_SIZE > SEGMENT_MAX_SIZE)
+    {
+        return 0;
+    }
+    size_t segment_size = ((SEGMENT_HEADER_SIZE + size + 2 * CHUNK_HEADER_SIZE + allocation_size - 1) / allocation_size) * allocation_size;
+    if (segment_size > SEGMENT_MAX_SIZE)
+    {
+        segment_size = SEGMENT_MAX_SIZE;
+    }
+    return HMMmap_segment(arena, segment_size) != NULL;
+}
+/**
+ * @brief Retrieves/Creates a free memory chunk of a specified size.
+ * 
+ * @param arena Arena to allocate from.
+ * @param size Size of the memory chunk to retrieve.
+ * @return Pointer to the free memory chunk if found, NULL otherwise.
+ */
+static mem_chunk_t *HMMget_free_chunk(hmm_arena_t *arena, size_t size)
+{    // Try to get a free block from the size-class bins.
+
+    mem_chunk_t *current = HMMget_free_block(arena, size);
+    if (current)
+    {
+        // Split the block if it's larger than required.
+
+        size_t current_size = HMMchunk_size(current);
+        if (current_size >= (size + CHUNK_HEADER_SIZE + MIN_PAYLOAD_SIZE))
+        {
+            mem_chunk_t *splitted = (mem_chunk_t *)((size_t)current + CHUNK_HEADER_SIZE + size);
+            // Initialize the new block.
+
+            splitted->size = (current_size - size - CHUNK_HEADER_SIZE) | (current->size & CHUNK_ZEROED);
+            HMMset_free(splitted);
+            HMMadd_free_block(arena, splitted);
+            HMMset_chunk_size(current, size);
+        }
+        return current;
+    }
+        // If no free block is large enough, allocate new memory from the system.
+
+    if (!HMMgrow_arena(arena, size))
+    {
+        return NULL;
+    }
+    return HMMget_free_chunk(arena, size);
+}
+/**
+ * @brief Gives the free chunk at the end of a segment back to the system.
+ * 
+ * A segment the chunk spans entirely is unlinked and unmapped, wherever it sits in
+ * the arena's list. Otherwise the chunk's header becomes the new fencepost and the
+ * pages past it are dropped.
+ * 
+ * @param arena Arena owning the segment.
+ * @param last Free chunk preceding the fencepost, already removed from the bins.
+ */
+static void HMMrelease_last_chunk(hmm_arena_t *arena, mem_chunk_t *last)
+{
+    hmm_segment_t *segment = HMMsegment_for_address(last);
+    if (last == HMMsegment_first_chunk(segment))
+    {
+        if (segment->prev)
+        {
+            segment->prev->next = segment->next;
+        }
+        else
+        {
+            arena->segments = segment->next;
+        }
+        if (segment->next)
+        {
+            segment->next->prev = segment->prev;
+        }
+        HMMstat_add(STAT_TRIM_EVENTS, 1);
+        HMMstat_add(STAT_TRIMMED_BYTES, segment->size);
+        munmap(segment, SEGMENT_MAX_SIZE);
+        HMMstat_add(STAT_MUNMAP_CALLS, 1);
+        return;
+    }
+    segment->tail = last;
+    segment->tail->size = 0;
+    size_t granule = HMMrelease_granule();
+    size_t used = (unsigned char *)last + CHUNK_HEADER_SIZE - (unsigned char *)segment;
+    size_t new_size = (used + granule - 1) & ~(granule - 1);
+        // Keep the memory past the fencepost zero, so the next extension starts out zeroed.
+        // Up to a huge page is too much to clear under the arena lock: it is left as it
+        // is, and the next extension is not flagged zeroed instead.
+
+    if (new_size - used <= (size_t)sysconf(_SC_PAGESIZE))
+    {
+        memset((unsigned char *)segment + used, 0, new_size - used);
+    }
+    else
+    {
+        segment->dirty_end = new_size;
+    }
+    if (new_size < segment->size)
+    {
+        // Replace the released pages with a fresh PROT_NONE mapping.
+
+        HMMstat_add(STAT_TRIM_EVENTS, 1);
+        HMMstat_add(STAT_TRIMMED_BYTES, segment->size - new_size);
+        HMMstat_add(STAT_MMAP_CALLS, 1);
+        if (mmap((unsigned char *)segment + new_size, segment->size - new_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED)
+        {
+            segment->size = new_size;
+        }
+        else
+        {
+            madvise((unsigned char *)segment + new_size, segment->size - new_size, MADV_DONTNEED);
+            HMMstat_add(STAT_MADVISE_CALLS, 1);
+        }
+    }
+}
+/**
+ * @brief Returns the slab holding an object.
+ * 
+ * @param ptr Pointer to an object inside a slab segment.
+ * @return Pointer to the slab header.
+ */
+static hmm_slab_t *HMMslab_for_object(void *ptr)
+{
+    return (hmm_slab_t *)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE - 1));
+}
+/**
+ * @brief Inserts a slab at the head of the partial list of its class.
+ * 
+ * @param arena Arena owning the slab.
+ * @param slab Slab with at least one free object.
+ */
+static void HMMslab_link(hmm_arena_t *arena, hmm_slab_t *slab)
+{
+    hmm_slab_t **head = &arena->slab_partial[(slab->object_size - MIN_PAYLOAD_SIZE) >> ALIGNMENT_SHIFT];
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+/**
+ * @brief Removes a slab from the partial list of its class.
+ * 
+ * @param arena Arena owning the slab.
+ * @param slab Slab to remove.
+ */
+static void HMMslab_unlink(hmm_arena_t *arena, hmm_slab_t *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        arena->slab_partial[(slab->object_size - MIN_PAYLOAD_SIZE) >> ALIGNMENT_SHIFT] = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+/**
+ * @brief Returns the bitmap of the purged slabs of a slab segment.
+ * 
+ * The bitmap lives right after the segment header, in the first slab-sized run,
+ * which no slab is carved from.
+ * 
+ * @param segment Slab segment.
+ * @return Bitmap whose bit i is set while the slab at i * SLAB_SIZE is purged.
+ */
+static uint64_t *HMMslab_purged_map(hmm_segment_t *segment)
+{
+    return (uint64_t *)((unsigned char *)segment + SEGMENT_HEADER_SIZE);
+}
+/**
+ * @brief Inserts a slab that no longer has any object handed out at the head of the empty list.
+ * 
+ * @param arena Arena owning the slab.
+ * @param slab Slab to insert, on no list.
+ */
+static void HMMslab_empty_push(hmm_arena_t *arena, hmm_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = arena->slab_empty;
+    if (arena->slab_empty)
+    {
+        arena->slab_empty->prev = slab;
+    }
+    arena->slab_empty = slab;
+    slab->freed_epoch = (uint32_t)__atomic_load_n(&scavenger_epoch, __ATOMIC_RELAXED);
+    HMMsegment_for_address(slab)->slabs_free++;
+}
+/**
+ * @brief Removes a slab from the empty list.
+ * 
+ * @param arena Arena owning the slab.
+ * @param slab Slab to remove.
+ */
+static void HMMslab_empty_unlink(hmm_arena_t *arena, hmm_slab_t *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        arena->slab_empty = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+    HMMsegment_for_address(slab)->slabs_free--;
+}
+/**
+ * @brief Unmaps a slab segment none of whose slabs has an object handed out.
+ * 
+ * @param arena Arena owning the segment (locked by the caller).
+ * @param segment Slab segment whose carved slabs are all on the empty list or purged.
+ */
+static void HMMslab_release_segment(hmm_arena_t *arena, hmm_segment_t *segment)
+{
+    uint64_t *purged = HMMslab_purged_map(segment);
+    for (size_t run = 1; run < segment->carved / SLAB_SIZE; run++)
+    {
+        if (!(purged[run / 64] & ((uint64_t)1 << (run % 64))))
+        {
+            HMMslab_empty_unlink(arena, (hmm_slab_t *)((unsigned char *)segment + run * SLAB_SIZE));
+        }
+    }
+    if (segment->prev)
+    {
+        segment->prev->next = segment->next;
+    }
+    else
+    {
+        arena->slab_segments = segment->next;
+    }
+    if (segment->next)
+    {
+        segment->next->prev = segment->prev;
+    }
+    HMMstat_add(STAT_TRIM_EVENTS, 1);
+    HMMstat_add(STAT_TRIMMED_BYTES, segment->size);
+    munmap(segment, SEGMENT_MAX_SIZE);
+    HMMstat_add(STAT_MUNMAP_CALLS, 1);
+}
+/**
+ * @brief Takes an unused slab: from the empty list, a purged one, or carved from a slab segment.
+ * 
+ * Slab segments are made readable and writable grow_bytes at a time. Slabs that
+ * become empty are kept for reuse by any class until HMMslab_scavenge gives their
+ * pages back, and a segment is unmapped once none of its slabs is in use.
+ * 
+ * @param arena Arena needing a slab.
+ * @return Pointer to the slab, NULL if mapping failed.
+ */
+static hmm_slab_t *HMMslab_new(hmm_arena_t *arena)
+{
+    hmm_slab_t *slab = arena->slab_empty;
+    if (slab)
+    {
+        HMMslab_empty_unlink(arena, slab);
+        return slab;
+    }
+        // Refill purged slabs before carving new ones, so that older segments stay in use.
+
+    for (hmm_segment_t *segment = arena->slab_segments; segment; segment = segment->next)
+    {
+        if (segment->slabs_purged != 0)
+        {
+            uint64_t *purged = HMMslab_purged_map(segment);
+            size_t word = 0;
+            while (purged[word] == 0)
+            {
+                word++;
+            }
+            size_t run = word * 64 + __builtin_ctzll(purged[word]);
+            purged[word] &= purged[word] - 1;
+            segment->slabs_purged--;
+            segment->slabs_free--;
+            return (hmm_slab_t *)((unsigned char *)segment + run * SLAB_SIZE);
+        }
+    }
+    size_t step = __atomic_load_n(&grow_bytes, __ATOMIC_RELAXED);
+    hmm_segment_t *segment = arena->slab_segments;
+    if ((segment == NULL) || (segment->carved == SEGMENT_MAX_SIZE))
+    {
+        unsigned char *aligned = HMMreserve_segment(SEGMENT_MAX_SIZE);
+        if (aligned)
+        {
+            HMMstat_add(STAT_MPROTECT_CALLS, 1);
+        }
+        if ((aligned == NULL) || (mprotect(aligned, step, PROT_READ | PROT_WRITE) != 0))
+        {
+            if (aligned)
+            {
+                munmap(aligned, SEGMENT_MAX_SIZE);
+                HMMstat_add(STAT_MUNMAP_CALLS, 1);
+            }
+            return NULL;
+        }
+        HMMadvise_range(arena->node, aligned, step);
+            // The first slab-sized run holds the segment header and the purged bitmap.
+
+        segment = (hmm_segment_t *)aligned;
+        segment->arena = arena;
+        segment->kind = SEGMENT_SLAB;
+        segment->prev = NULL;
+        segment->next = arena->slab_segments;
+        segment->size = step;
+        segment->tail = NULL;
+        segment->carved = SLAB_SIZE;
+        segment->slabs_free = 0;
+        segment->slabs_purged = 0;
+        if (arena->slab_segments)
+        {
+            arena->slab_segments->prev = segment;
+        }
+        arena->slab_segments = segment;
+    }
+    if (segment->carved == segment->size)
+    {
+        // grow_bytes may have changed since the segment was mapped; stay inside the reservation.
+
+        if (step > SEGMENT_MAX_SIZE - segment->size)
+        {
+            step = SEGMENT_MAX_SIZE - segment->size;
+        }
+        HMMstat_add(STAT_MPROTECT_CALLS, 1);
+        if (mprotect((unsigned char *)segment + segment->size, step, PROT_READ | PROT_WRITE) != 0)
+        {
+            return NULL;
+        }
+        HMMadvise_range(arena->node, (unsigned char *)segment + segment->size, step);
+        segment->size += step;
+    }
+    slab = (hmm_slab_t *)((unsigned char *)segment + segment->carved);
+    segment->carved += SLAB_SIZE;
+    return slab;
+}
+/**
+ * @brief Allocates an object from the slabs of its class.
+ * 
+ * @param arena Arena to allocate from (locked by the caller).
+ * @param size Object size (result of HMMrequest_size, at most SLAB_MAX_SIZE).
+ * @return Pointer to the object, NULL if no slab could be mapped.
+ */
+static void *HMMslab_alloc(hmm_arena_t *arena, size_t size)
+{
+    hmm_slab_t *slab = arena->slab_partial[(size - MIN_PAYLOAD_SIZE) >> ALIGNMENT_SHIFT];
+    if (slab == NULL)
+    {
+        slab = HMMslab_new(arena);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->object_size = size;
+        slab->used = 0;
+        slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / size;
+        for (size_t word = 0; word < SLAB_MAP_WORDS; word++)
+        {
+            size_t first = word * 64;
+            if (first + 64 <= slab->capacity)
+            {
+                slab->free_map[word] = ~(uint64_t)0;
+            }
+            else if (first < slab->capacity)
+            {
+                slab->free_map[word] = ((uint64_t)1 << (slab->capacity - first)) - 1;
+            }
+            else
+            {
+                slab->free_map[word] = 0;
+            }
+        }
+        HMMslab_link(arena, slab);
+    }
+        // Take the lowest free object, keeping allocations packed at the start of the slab.
+
+    size_t word = 0;
+    while (slab->free_map[word] == 0)
+    {
+        word++;
+    }
+    size_t bit = __builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word] &= slab->free_map[word] - 1;
+    if (++slab->used == slab->capacity)
+    {
+        HMMslab_unlink(arena, slab);
+    }
+    return (unsigned char *)slab + SLAB_HEADER_SIZE + (word * 64 + bit) * slab->object_size;
+}
+/**
+ * @brief Returns an object to its slab.
+ * 
+ * A slab that becomes empty moves to the arena's empty list unless it is the last
+ * partial slab of its class. Without a scavenger, a slab segment other than the
+ * newest is unmapped as soon as none of its slabs is in use.
+ * 
+ * @param arena Arena owning the slab (locked by the caller).
+ * @param ptr Pointer to the object.
+ */
+static void HMMslab_free(hmm_arena_t *arena, void *ptr)
+{
+    hmm_slab_t *slab = HMMslab_for_object(ptr);
+    size_t index = ((unsigned char *)ptr - (unsigned char *)slab - SLAB_HEADER_SIZE) / slab->object_size;
+    uint64_t mask = (uint64_t)1 << (index % 64);
+        // Ignore the request if the object is already free.
+
+    if (slab->free_map[index / 64] & mask)
+    {
+        return;
+    }
+    slab->free_map[index / 64] |= mask;
+    if (slab->used-- == slab->capacity)
+    {
+        HMMslab_link(arena, slab);
+    }
+    if ((slab->used == 0) && (slab->prev || slab->next))
+    {
+        HMMslab_unlink(arena, slab);
+        HMMslab_empty_push(arena, slab);
+        hmm_segment_t *segment = HMMsegment_for_address(slab);
+        if ((segment != arena->slab_segments) && (segment->slabs_free == segment->carved / SLAB_SIZE - 1) &&
+            (__atomic_load_n(&decay_ms, __ATOMIC_RELAXED) == 0))
+        {
+            HMMslab_release_segment(arena, segment);
+        }
+    }
+}
+/**
+ * @brief Tells whether every slab of a fully free slab segment has stayed free long enough.
+ * 
+ * @param segment Slab segment whose carved slabs are all on the empty list or purged.
+ * @param epoch Current scavenger tick.
+ * @param age Ticks each slab must have stayed on the empty list.
+ * @return 1 if the segment can be unmapped, 0 otherwise.
+ */
+static int HMMslab_segment_decayed(hmm_segment_t *segment, size_t epoch, size_t age)
+{
+    uint64_t *purged = HMMslab_purged_map(segment);
+    for (size_t run = 1; (segment->slabs_purged != segment->slabs_free) && (run < segment->carved / SLAB_SIZE); run++)
+    {
+        hmm_slab_t *slab = (hmm_slab_t *)((unsigned char *)segment + run * SLAB_SIZE);
+        if (!(purged[run / 64] & ((uint64_t)1 << (run % 64))) && ((uint32_t)epoch - slab->freed_epoch < age))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+/**
+ * @brief Gives back to the system the pages of the empty slabs of an arena that have decayed.
+ * 
+ * Empty slabs left as the last partial slab of their class move to the empty list
+ * first. A slab that has stayed on the empty list for age ticks is purged, its page
+ * dropped with MADV_DONTNEED, unless huge pages are on (purging one slab would split
+ * its huge page); a slab segment none of whose slabs is in use is unmapped.
+ * 
+ * @param arena Arena to scavenge (locked by the caller).
+ * @param epoch Current scavenger tick.
+ * @param age Ticks a slab must have stayed empty: DECAY_STEPS, or 0 to return every empty slab.
+ * @return 1 if memory was returned, 0 otherwise.
+ */
+static int HMMslab_scavenge(hmm_arena_t *arena, size_t epoch, size_t age)
+{
+    int released = 0;
+    for (size_t class = 0; class < SLAB_CLASSES; class++)
+    {
+        hmm_slab_t *slab = arena->slab_partial[class];
+        while (slab)
+        {
+            hmm_slab_t *next = slab->next;
+            if (slab->used == 0)
+            {
+                HMMslab_unlink(arena, slab);
+                HMMslab_empty_push(arena, slab);
+            }
+            slab = next;
+        }
+    }
+    hmm_slab_t *slab = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED) ? NULL : arena->slab_empty;
+    while (slab)
+    {
+        hmm_slab_t *next = slab->next;
+        if ((uint32_t)epoch - slab->freed_epoch >= age)
+        {
+            // The links live in the page about to be dropped: unlink the slab first.
+
+            HMMslab_empty_unlink(arena, slab);
+            HMMstat_add(STAT_MADVISE_CALLS, 1);
+            if (madvise(slab, SLAB_SIZE, MADV_DONTNEED) == 0)
+            {
+                hmm_segment_t *segment = HMMsegment_for_address(slab);
+                size_t run = ((unsigned char *)slab - (unsigned char *)segment) / SLAB_SIZE;
+                HMMslab_purged_map(segment)[run / 64] |= (uint64_t)1 << (run % 64);
+                segment->slabs_purged++;
+                segment->slabs_free++;
+                HMMstat_add(STAT_PURGED_BYTES, SLAB_SIZE);
+                released = 1;
+            }
+            else
+            {
+                HMMslab_empty_push(arena, slab);
+            }
+        }
+        slab = next;
+    }
+    hmm_segment_t *segment = arena->slab_segments;
+    while (segment)
+    {
+        hmm_segment_t *next = segment->next;
+        if ((segment->slabs_free == segment->carved / SLAB_SIZE - 1) && HMMslab_segment_decayed(segment, epoch, age))
+        {
+            HMMslab_release_segment(arena, segment);
+            released = 1;
+        }
+        segment = next;
+    }
+    return released;
+}
+/**
+ * @brief Returns the usable size of an allocated block.
+ * 
+ * @param ptr Pointer to a block returned by malloc.
+ * @return Object size for slab objects, payload size for chunks.
+ */
+static size_t HMMusable_size(void *ptr)
+{
+    if (HMMsegment_for_address(ptr)->kind == SEGMENT_SLAB)
+    {
+        return HMMslab_for_object(ptr)->object_size;
+    }
+    return HMMchunk_size(HMMpayload_chunk(ptr));
+}
+/**
+ * @brief Frees the memory associated with a given pointer.
+ * 
+ * @param arena Arena owning the memory (locked by the caller).
+ * @param ptr Pointer to the memory to be freed.
+ */
+static void HMMfree(hmm_arena_t *arena, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    if (HMMsegment_for_address(ptr)->kind == SEGMENT_SLAB)
+    {
+        HMMslab_free(arena, ptr);
+        return;
+    }
+    // Get the memory chunk from the given pointer.
+
+    mem_chunk_t *alloacted_member = HMMpayload_chunk(ptr); 
+        // Ignore the request if the memory is already free.
+
+    if (alloacted_member->size & CHUNK_FREE)
+    {
+        return;
+    }
+    alloacted_member->size &= ~(size_t)CHUNK_ZEROED;
+    // Coalesce with both neighbours.
+
+    alloacted_member = HMMcoalesce(arena, alloacted_member);
+    HMMadd_free_block(arena, alloacted_member);
+        // Unless the scavenger thread returns memory in the background, free excess
+        // memory if the merged chunk ends its segment and is large enough or spans
+        // the whole segment.
+
+    size_t threshold = __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED);
+    if ((__atomic_load_n(&decay_ms, __ATOMIC_RELAXED) == 0) && (arena->current_free_size >= threshold) && (HMMchunk_size(HMMnext_chunk(alloacted_member)) == 0) &&
+        ((HMMchunk_size(alloacted_member) + CHUNK_HEADER_SIZE >= threshold) || (alloacted_member == HMMsegment_first_chunk(HMMsegment_for_address(alloacted_member)))))
+    {
+        HMMremove_free_block(arena, alloacted_member);
+        HMMrelease_last_chunk(arena, alloacted_member);
+    }
+}
+/**
+ * @brief Rounds a requested size up to the payload size of the chunk serving it.
+ * 
+ * @param size Requested size.
+ * @return Payload size, or 0 if the request is too large.
+ */
+static size_t HMMrequest_size(size_t size)
+{
+    if (size > PTRDIFF_MAX)
+    {
+        return 0;
+    }
+    size = (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
+    if (size < MIN_PAYLOAD_SIZE)
+    {
+        size = MIN_PAYLOAD_SIZE;
+    }
+    return size;
+}
+/**
+ * @brief Allocates memory of a specified size.
+ * 
+ * @param arena Arena to allocate from (locked by the caller).
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMmalloc(hmm_arena_t *arena, size_t size)
+{
+    size = HMMrequest_size(size);
+    if (size == 0)
+    {
+        return NULL;
+    }
+    if (size <= SLAB_MAX_SIZE)
+    {
+        return HMMslab_alloc(arena, size);
+    }
+    mem_chunk_t *allocated_area_data = HMMget_free_chunk(arena, size);
+    if (allocated_area_data == NULL)
+    {
+        return NULL;
+    }
+    HMMset_in_use(allocated_area_data);
+    return (void *)((unsigned char *)allocated_area_data + CHUNK_HEADER_SIZE);
+}
+/**
+ * @brief Allocates a number of blocks of the same size under one lock acquisition.
+ * 
+ * Slab-sized blocks come from the slabs one by one. Larger ones are carved from a
+ * single free chunk holding all of them, so the free index is searched and split
+ * once for the whole batch; when no chunk that large can be had, the batch is
+ * carved in smaller runs.
+ * 
+ * @param arena Arena to allocate from (locked by the caller).
+ * @param size Size of each block.
+ * @param n Number of blocks.
+ * @param out Output: the blocks allocated.
+ * @return Number of blocks allocated, less than n if memory ran out.
+ */
+static size_t HMMmalloc_batch(hmm_arena_t *arena, size_t size, size_t n, void **out)
+{
+    size = HMMrequest_size(size);
+    if (size == 0)
+    {
+        return 0;
+    }
+    size_t done = 0;
+    if (size <= SLAB_MAX_SIZE)
+    {
+        while ((done < n) && ((out[done] = HMMslab_alloc(arena, size)) != NULL))
+        {
+            done++;
+        }
+        return done;
+    }
+    size_t stride = CHUNK_HEADER_SIZE + size;
+    size_t run_max = (SEGMENT_MAX_SIZE - SEGMENT_HEADER_SIZE - CHUNK_HEADER_SIZE) / stride;
+    size_t run = (n < run_max) ? n : run_max;
+    while ((done < n) && (run != 0))
+    {
+        if (run > n - done)
+        {
+            run = n - done;
+        }
+        mem_chunk_t *chunk = HMMget_free_chunk(arena, run * stride - CHUNK_HEADER_SIZE);
+        if (chunk == NULL)
+        {
+            run /= 2;
+            continue;
+        }
+        HMMset_in_use(chunk);
+            // Cut the run into blocks; the last one keeps whatever the split left over.
+
+        unsigned char *end = (unsigned char *)HMMnext_chunk(chunk);
+        HMMset_chunk_size(chunk, size);
+        for (size_t i = 0; i < run; i++)
+        {
+            if (i != 0)
+            {
+                chunk = (mem_chunk_t *)((unsigned char *)chunk + stride);
+                chunk->size = size;
+            }
+            if (i == run - 1)
+            {
+                HMMset_chunk_size(chunk, end - (unsigned char *)chunk - CHUNK_HEADER_SIZE);
+            }
+            out[done++] = (unsigned char *)chunk + CHUNK_HEADER_SIZE;
+        }
+    }
+    return done;
+}
+/**
+ * @brief Gives the excess of an allocated chunk back, merged with the following chunk if that one is free.
+ * 
+ * @param arena Arena owning the chunk (locked by the caller).
+ * @param chunk Allocated chunk.
+ * @param size Payload size to keep (multiple of ALIGNMENT).
+ */
+static void HMMtrim_chunk(hmm_arena_t *arena, mem_chunk_t *chunk, size_t size)
+{
+    size_t chunk_size = HMMchunk_size(chunk);
+    if (chunk_size >= size + CHUNK_HEADER_SIZE + MIN_PAYLOAD_SIZE)
+    {
+        mem_chunk_t *rest = (mem_chunk_t *)((unsigned char *)chunk + CHUNK_HEADER_SIZE + size);
+        rest->size = chunk_size - size - CHUNK_HEADER_SIZE;
+        HMMset_chunk_size(chunk, size);
+        rest = HMMcoalesce(arena, rest);
+        HMMadd_free_block(arena, rest);
+    }
+}
+/**
+ * @brief Allocates memory whose address is a multiple of a given alignment.
+ * 
+ * A chunk large enough for the alignment is taken and the slack in front of the
+ * aligned address is split off as a free chunk of its own, as is the excess past
+ * the requested size, so no memory is wasted. Slabs are bypassed: their objects
+ * are only ALIGNMENT-aligned.
+ * 
+ * @param arena Arena to allocate from (locked by the caller).
+ * @param alignment Power of two larger than ALIGNMENT.
+ * @param size Payload size (result of HMMrequest_size).
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMmemalign(hmm_arena_t *arena, size_t alignment, size_t size)
+{
+        // Room for the worst-case slack, which must be able to hold a chunk of its own.
+
+    size_t slack = alignment - ALIGNMENT + CHUNK_HEADER_SIZE + MIN_PAYLOAD_SIZE;
+    if (size > PTRDIFF_MAX - slack)
+    {
+        return NULL;
+    }
+    mem_chunk_t *chunk = HMMget_free_chunk(arena, size + slack);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    HMMset_in_use(chunk);
+    uintptr_t payload = (uintptr_t)chunk + CHUNK_HEADER_SIZE;
+    if (payload & (alignment - 1))
+    {
+        // Split the leading slack off; the chunk before it is in use, so it stays a chunk of its own.
+
+        uintptr_t aligned = (payload + CHUNK_HEADER_SIZE + MIN_PAYLOAD_SIZE + alignment - 1) & ~((uintptr_t)alignment - 1);
+        mem_chunk_t *lead = chunk;
+        chunk = HMMpayload_chunk((void *)aligned);
+        chunk->size = (unsigned char *)HMMnext_chunk(lead) - (unsigned char *)chunk - CHUNK_HEADER_SIZE;
+        HMMset_chunk_size(lead, (unsigned char *)chunk - (unsigned char *)lead - CHUNK_HEADER_SIZE);
+        HMMset_free(lead);
+        HMMadd_free_block(arena, lead);
+    }
+    HMMtrim_chunk(arena, chunk, size);
+    return (void *)((unsigned char *)chunk + CHUNK_HEADER_SIZE);
+}
+/**
+ * @brief Resizes an allocated block without moving it, if its surroundings allow it.
+ * 
+ * A slab object keeps its slot while the new size fits in it. A chunk shrinks by
+ * splitting off its tail, and grows into the free chunk that follows it; the last
+ * chunk of a segment can also grow by extending the segment. Whatever is left over
+ * goes back to the free index.
+ * 
+ * @param arena Arena owning the block (locked by the caller).
+ * @param ptr Pointer to the allocated block.
+ * @param size New payload size (result of HMMrequest_size).
+ * @return 1 if the block now holds size bytes, 0 if it has to move.
+ */
+static int HMMresize_in_place(hmm_arena_t *arena, void *ptr, size_t size)
+{
+    hmm_segment_t *segment = HMMsegment_for_address(ptr);
+    if (segment->kind == SEGMENT_SLAB)
+    {
+        return size <= HMMslab_for_object(ptr)->object_size;
+    }
+    mem_chunk_t *chunk = HMMpayload_chunk(ptr);
+    size_t old_size = HMMchunk_size(chunk);
+    if (size > old_size)
+    {
+        mem_chunk_t *next = HMMnext_chunk(chunk);
+        size_t available = old_size;
+        if (next->size & CHUNK_FREE)
+        {
+            available += CHUNK_HEADER_SIZE + HMMchunk_size(next);
+        }
+        if (available < size)
+        {
+            // Only the last chunk of its segment can grow past its free neighbour.
+
+            mem_chunk_t *last = (next->size & CHUNK_FREE) ? HMMnext_chunk(next) : next;
+            if ((HMMchunk_size(last) != 0) || !HMMgrow_segment(arena, segment, size - old_size))
+            {
+                return 0;
+            }
+            next = HMMnext_chunk(chunk);
+        }
+            // Absorb the free neighbour.
+
+        HMMremove_free_block(arena, next);
+        HMMset_chunk_size(chunk, old_size + CHUNK_HEADER_SIZE + HMMchunk_size(next));
+        HMMset_in_use(chunk);
+    }
+    HMMtrim_chunk(arena, chunk, size);
+    return 1;
+}
+/**
+ * @brief Changes the size of the memory block pointed to by a given pointer.
+ * 
+ * The block is resized in place when possible, and moved otherwise.
+ * 
+ * @param arena Arena owning the memory block (locked by the caller).
+ * @param ptr Pointer to the previously allocated memory block.
+ * @param size New size for the memory block.
+ * @return Pointer to the reallocated memory block if successful, NULL otherwise.
+ */
+static void *HMMrealloc(hmm_arena_t *arena, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return HMMmalloc(arena, size);
+    }
+    if (size == 0)
+    {
+        HMMfree(arena, ptr);
+        return HMMmalloc(arena, ALIGNMENT);
+    }
+    size = HMMrequest_size(size);
+    if (size == 0)
+    {
+        return NULL;
+    }
+    if (HMMresize_in_place(arena, ptr, size))
+    {
+        return ptr;
+    }
+    void *allocated_chunk = HMMmalloc(arena, size);
+    if (allocated_chunk == NULL)
+    {
+        return NULL;
+    }
+    size_t allocation_size;
+    if (HMMusable_size(ptr) < HMMusable_size(allocated_chunk))
+    {
+        allocation_size = HMMusable_size(ptr);
+    }
+    else
+    {
+        allocation_size = HMMusable_size(allocated_chunk);
+    }
+    memcpy(allocated_chunk, ptr, allocation_size);
+    HMMfree(arena, ptr);
+    return (void *)allocated_chunk;
+}
+/**
+ * @brief Allocates a chunk backed by its own anonymous mapping.
+ * 
+ * The mapping is an mmap segment, so free can tell it apart by masking the address.
+ * The chunk normally follows the segment header; a larger alignment moves it further
+ * into the mapping, which is SEGMENT_MAX_SIZE-aligned.
+ * 
+ * @param alignment Alignment of the payload (a power of two, at least ALIGNMENT and at most MAX_ALIGNMENT).
+ * @param size Payload size (result of HMMrequest_size).
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMmmap_alloc(size_t alignment, size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t offset = (SEGMENT_HEADER_SIZE + CHUNK_HEADER_SIZE + alignment - 1) & ~(alignment - 1);
+    size_t length = (size + offset + page_size - 1) & ~(page_size - 1);
+    if (length < size)
+    {
+        return NULL;
+    }
+    unsigned char *mapping = HMMreserve_segment(length);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    HMMstat_add(STAT_MPROTECT_CALLS, 1);
+    if (mprotect(mapping, length, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(mapping, length);
+        HMMstat_add(STAT_MUNMAP_CALLS, 1);
+        return NULL;
+    }
+        // Bind the block to the node of the allocating thread's arena. It stays on small
+        // pages: a huge page is cleared in full when first touched, a cost each
+        // short-lived mapping would pay again, for pages the block may never use.
+
+    HMMbind_range((thread_arena != NULL) ? thread_arena->node : -1, mapping, length);
+    HMMstat_add(STAT_MMAP_CHUNKS, 1);
+    HMMstat_add(STAT_MMAP_BYTES, length);
+    hmm_segment_t *segment = (hmm_segment_t *)mapping;
+    segment->arena = NULL;
+    segment->kind = SEGMENT_MMAP;
+    segment->size = length;
+    mem_chunk_t *chunk = HMMpayload_chunk(mapping + offset);
+    chunk->size = (length - offset) | CHUNK_ZEROED;
+    return mapping + offset;
+}
+/**
+ * @brief Unmaps a chunk allocated by HMMmmap_alloc.
+ * 
+ * @param segment Pointer to the mmap segment holding the chunk.
+ */
+static void HMMmmap_free(hmm_segment_t *segment)
+{
+    HMMstat_add(STAT_MMAP_CHUNKS, (size_t)-1);
+    HMMstat_add(STAT_MMAP_BYTES, -segment->size);
+    munmap(segment, segment->size);
+    HMMstat_add(STAT_MUNMAP_CALLS, 1);
+}
+/**
+ * @brief Resizes a chunk allocated by HMMmmap_alloc without copying its contents.
+ * 
+ * The mapping is resized in place when the pages after it are free. Otherwise
+ * mremap moves its page table entries onto a fresh SEGMENT_MAX_SIZE-aligned
+ * reservation, so the block stays findable from its address whatever its size.
+ * The chunk keeps its offset inside the mapping, and with it its alignment.
+ * 
+ * @param ptr Pointer to the block, inside an mmap segment.
+ * @param size New payload size (result of HMMrequest_size).
+ * @return Pointer to the resized memory, NULL if it could not be remapped.
+ */
+static void *HMMmmap_realloc(void *ptr, size_t size)
+{
+    hmm_segment_t *segment = HMMsegment_for_address(ptr);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t offset = (unsigned char *)ptr - (unsigned char *)segment;
+    size_t length = (size + offset + page_size - 1) & ~(page_size - 1);
+    if (length < size)
+    {
+        return NULL;
+    }
+    unsigned char *mapping = (unsigned char *)segment;
+    size_t old_length = segment->size;
+    if (length != old_length)
+    {
+        HMMstat_add(STAT_MREMAP_CALLS, 1);
+    }
+    if ((length != old_length) && (mremap(mapping, old_length, length, 0) == MAP_FAILED))
+    {
+        unsigned char *target = HMMreserve_segment(length);
+        if (target == NULL)
+        {
+            return NULL;
+        }
+        HMMstat_add(STAT_MREMAP_CALLS, 1);
+        if (mremap(mapping, old_length, length, MREMAP_MAYMOVE | MREMAP_FIXED, target) == MAP_FAILED)
+        {
+            munmap(target, length);
+            HMMstat_add(STAT_MUNMAP_CALLS, 1);
+            return NULL;
+        }
+        mapping = target;
+    }
+    HMMstat_add(STAT_MMAP_BYTES, length - old_length);
+    segment = (hmm_segment_t *)mapping;
+    segment->size = length;
+    HMMpayload_chunk(mapping + offset)->size = length - offset;
+    return mapping + offset;
+}
+/**
+ * @brief Returns the arena owning an allocated block.
+ * 
+ * Every chunk and slab lives in a SEGMENT_MAX_SIZE-aligned segment whose header names its arena.
+ * 
+ * @param address Pointer to an allocated chunk or block.
+ * @return Pointer to the owning arena.
+ */
+static hmm_arena_t *HMMarena_for_address(void *address)
+{
+    return HMMsegment_for_address(address)->arena;
+}
+/**
+ * @brief Locks an arena, counting the acquisition and whether another thread held the lock.
+ * 
+ * @param arena Arena to lock.
+ * @return 0 on success, the pthread_mutex_lock error otherwise.
+ */
+static int HMMlock_arena(hmm_arena_t *arena)
+{
+    HMMstat_add(STAT_LOCK_ACQUISITIONS, 1);
+    if (pthread_mutex_trylock(&arena->alloc_mutex) == 0)
+    {
+        return 0;
+    }
+    HMMstat_add(STAT_LOCK_CONTENTIONS, 1);
+    return pthread_mutex_lock(&arena->alloc_mutex);
+}
+/**
+ * @brief Frees every block pushed on an arena's remote-free stack.
+ * 
+ * @param arena Arena to drain (locked by the caller).
+ */
+static void HMMremote_drain(hmm_arena_t *arena)
+{
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+        // Detach the whole stack at once; pushers only ever touch its head.
+
+    tcache_entry_t *entry = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    size_t drained = 0;
+    while (entry)
+    {
+        tcache_entry_t *next = entry->next;
+        entry->key = NULL;
+        HMMfree(arena, entry);
+        entry = next;
+        drained++;
+    }
+    __atomic_fetch_sub(&arena->remote_count, drained, __ATOMIC_RELAXED);
+}
+/**
+ * @brief Hands a block back to the arena owning it without taking its lock.
+ * 
+ * The block is pushed on the arena's remote-free stack and freed by the next
+ * allocation from that arena. Once REMOTE_FREE_BATCH blocks are pending, the
+ * pusher drains them itself if the arena's lock happens to be free.
+ * 
+ * A block whose key says it is already pending is looked up in the stack under
+ * the arena's lock, as its data may hold the same value; callers holding an
+ * arena lock (HMMtcache_flush) clear the key first.
+ * 
+ * @param arena Arena owning the block.
+ * @param ptr Pointer to the memory being freed.
+ */
+static void HMMremote_free(hmm_arena_t *arena, void *ptr)
+{
+    tcache_entry_t *entry = ptr;
+        // Ignore chunks already free. The owner may be rewriting the PREV_FREE flag of
+        // the size word under its lock, so the word is read atomically; the CHUNK_FREE
+        // flag cannot change while the caller still owns the chunk.
+
+    if ((HMMsegment_for_address(ptr)->kind == SEGMENT_HEAP) && (__atomic_load_n(&HMMpayload_chunk(ptr)->size, __ATOMIC_RELAXED) & CHUNK_FREE))
+    {
+        return;
+    }
+    if (entry->key == &arena->remote_frees)
+    {
+        // Pushers only ever prepend and pops happen under the lock, so the stack can be walked while holding it.
+
+        if (HMMlock_arena(arena) != 0)
+        {
+            return;
+        }
+        tcache_entry_t *cur = __atomic_load_n(&arena->remote_frees, __ATOMIC_ACQUIRE);
+        while (cur && (cur != entry))
+        {
+            cur = cur->next;
+        }
+        if (cur == NULL)
+        {
+            HMMfree(arena, ptr);
+        }
+        pthread_mutex_unlock(&arena->alloc_mutex);
+        return;
+    }
+    entry->key = &arena->remote_frees;
+    entry->next = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&arena->remote_frees, &entry->next, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+    if ((__atomic_add_fetch(&arena->remote_count, 1, __ATOMIC_RELAXED) >= REMOTE_FREE_BATCH) &&
+        (pthread_mutex_trylock(&arena->alloc_mutex) == 0))
+    {
+        HMMstat_add(STAT_LOCK_ACQUISITIONS, 1);
+        HMMremote_drain(arena);
+        pthread_mutex_unlock(&arena->alloc_mutex);
+    }
+}
+/**
+ * @brief Reads a byte count from an environment variable.
+ * 
+ * @param name Name of the variable.
+ * @param value Set to the count: decimal digits with an optional K, M or G suffix.
+ * @return 1 if the variable is set to a valid count, 0 otherwise (value is left untouched).
+ */
+static int HMMenv_size(const char *name, size_t *value)
+{
+    const char *text = getenv(name);
+    if ((text == NULL) || (*text < '0') || (*text > '9'))
+    {
+        return 0;
+    }
+    char *end;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    unsigned int shift = 0;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    if ((*end != '\0') || (parsed > (SIZE_MAX >> shift)))
+    {
+        return 0;
+    }
+    *value = (size_t)parsed << shift;
+    return 1;
+}
+/**
+ * @brief Rounds a segment growth step up to a power of two from HUGE_PAGE_SIZE to SEGMENT_MAX_SIZE.
+ * 
+ * Steps of that form divide SEGMENT_MAX_SIZE and keep segments made of whole huge pages.
+ * 
+ * @param bytes Requested step.
+ * @return Step to use as grow_bytes.
+ */
+static size_t HMMgrow_step(size_t bytes)
+{
+    size_t step = HUGE_PAGE_SIZE;
+    while ((step < bytes) && (step < SEGMENT_MAX_SIZE))
+    {
+        step <<= 1;
+    }
+    return step;
+}
+/**
+ * @brief Sets the tunables given in the environment.
+ * 
+ * HMM_GROW_BYTES, HMM_TRIM_THRESHOLD, HMM_MMAP_THRESHOLD, HMM_TCACHE_MAX and HMM_ARENAS
+ * override the defaults of grow_bytes, trim_threshold, mmap_threshold, tcache_count and
+ * arena_max. Invalid values are ignored. getenv does not allocate, so this is safe
+ * before the first allocation.
+ */
+static void HMMtunables_load(void)
+{
+    size_t value;
+    if (HMMenv_size("HMM_GROW_BYTES", &value))
+    {
+        grow_bytes = HMMgrow_step(value);
+    }
+    if (HMMenv_size("HMM_TRIM_THRESHOLD", &value))
+    {
+        trim_threshold = value;
+    }
+    if (HMMenv_size("HMM_MMAP_THRESHOLD", &value))
+    {
+        mmap_threshold = value;
+    }
+    if (HMMenv_size("HMM_TCACHE_MAX", &value))
+    {
+        tcache_count = (value < TCACHE_COUNT_LIMIT) ? value : TCACHE_COUNT_LIMIT;
+    }
+    if (HMMenv_size("HMM_ARENAS", &value) && (value > 0))
+    {
+        pthread_mutex_lock(&arenas_mutex);
+        arena_max = (value < ARENA_LIMIT) ? value : ARENA_LIMIT;
+        pthread_mutex_unlock(&arenas_mutex);
+    }
+}
+/**
+ * @brief Loads the tunables from the environment on first call.
+ * 
+ * Runs as a constructor and again on the first allocation of each thread, as other
+ * constructors may allocate before this one runs.
+ */
+static __attribute__((constructor)) void HMMtunables_init(void)
+{
+    pthread_once(&tunables_once, HMMtunables_load);
+}
+/**
+ * @brief Counts the online NUMA nodes, read from sysfs.
+ * 
+ * The node list ("0", "0-3", "0,2-3", ...) is read with read(2) rather than stdio,
+ * which would allocate while arenas_mutex is held.
+ */
+static void HMMnuma_init(void)
+{
+    numa_nodes = 1;
+    numa_max_node = 0;
+    char buf[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    ssize_t length = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (length <= 0)
+    {
+        return;
+    }
+    buf[length] = '\0';
+    size_t count = 0;
+    size_t highest = 0;
+    char *cursor = buf;
+    while ((*cursor >= '0') && (*cursor <= '9'))
+    {
+        size_t first = strtoul(cursor, &cursor, 10);
+        size_t last = first;
+        if (*cursor == '-')
+        {
+            last = strtoul(cursor + 1, &cursor, 10);
+        }
+        if ((last < first) || (last >= NUMA_MAX_NODES))
+        {
+            return;
+        }
+        count += last - first + 1;
+        highest = last;
+        if (*cursor == ',')
+        {
+            cursor++;
+        }
+    }
+    if (count > 1)
+    {
+        numa_nodes = count;
+        numa_max_node = highest;
+    }
+}
+/**
+ * @brief Returns the NUMA node the calling thread is running on.
+ * 
+ * @return Node number, or -1 on a single-node system or if it cannot be found.
+ */
+static int HMMcurrent_node(void)
+{
+    unsigned int cpu;
+    unsigned int node;
+    if ((numa_nodes <= 1) || (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) || (node > numa_max_node))
+    {
+        return -1;
+    }
+    return (int)node;
+}
+/**
+ * @brief Creates a new arena; arenas_mutex must be held and arena_count below ARENA_LIMIT.
+ * 
+ * @param node NUMA node the arena's memory is bound to, -1 for none.
+ * @return Pointer to the new arena, NULL if mapping it failed.
+ */
+static hmm_arena_t *HMMarena_create(int node)
+{
+        // Arena memory comes straight from mmap.
+
+    hmm_arena_t *arena = mmap(NULL, sizeof(hmm_arena_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    HMMstat_add(STAT_MMAP_CALLS, 1);
+    if (arena == MAP_FAILED)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&arena->alloc_mutex, NULL);
+    arena->index = arena_count;
+    arena->node = node;
+    arenas[arena_count] = arena;
+    __atomic_store_n(&arena_count, arena_count + 1, __ATOMIC_RELEASE);
+    return arena;
+}
+/**
+ * @brief Picks an arena among those of a NUMA node, creating one if needed.
+ * 
+ * Each node gets an equal share of arena_max. New threads are spread round-robin over
+ * the arenas of their node; a contended thread moves to a new arena of the node while
+ * under its share, otherwise to the node's next one. Threads only fall back to an arena
+ * of another node when the node has none and none can be created.
+ * 
+ * @param contended Arena the thread failed to lock, or NULL for a first binding.
+ * @param node Node the calling thread is running on.
+ * @return Pointer to the chosen arena.
+ */
+static hmm_arena_t *HMMnode_arena(hmm_arena_t *contended, int node)
+{
+    size_t share = arena_max / numa_nodes;
+    if (share == 0)
+    {
+        share = 1;
+    }
+    size_t count = 0;
+    size_t wanted = SIZE_MAX;
+    hmm_arena_t *first = NULL;
+    hmm_arena_t *after = NULL;
+    if (contended == NULL)
+    {
+        wanted = numa_next[node]++ % share;
+    }
+    for (size_t i = 0; i < arena_count; i++)
+    {
+        if (arenas[i]->node != node)
+        {
+            continue;
+        }
+        if (count == wanted)
+        {
+            return arenas[i];
+        }
+        if (first == NULL)
+        {
+            first = arenas[i];
+        }
+        if ((contended != NULL) && (after == NULL) && (i > contended->index))
+        {
+            after = arenas[i];
+        }
+        count++;
+    }
+    if ((count < share) && (arena_count < arena_max) && (arena_count < ARENA_LIMIT))
+    {
+        hmm_arena_t *arena = HMMarena_create(node);
+        if (arena)
+        {
+            return arena;
+        }
+    }
+    if (after)
+    {
+        return after;
+    }
+    if (first)
+    {
+        return first;
+    }
+    return arenas[arena_next++ % arena_count];
+}
+/**
+ * @brief Binds the calling thread to an arena, creating arenas lazily.
+ * 
+ * On NUMA systems the thread gets an arena of the node it runs on (HMMnode_arena).
+ * Otherwise new threads are spread round-robin, and a thread that found its arena
+ * contended moves to a new arena while fewer than arena_max exist, otherwise to the next one.
+ * 
+ * @param contended Arena the thread failed to lock, or NULL for a first binding.
+ * @return Pointer to the arena the thread is now bound to.
+ */
+static hmm_arena_t *HMMarena_assign(hmm_arena_t *contended)
+{
+    HMMtunables_init();
+    pthread_mutex_lock(&arenas_mutex);
+    if (arena_max == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arena_max = (cpus > 0) ? (size_t)cpus * ARENAS_PER_CPU : 1;
+        if (arena_max > ARENA_LIMIT)
+        {
+            arena_max = ARENA_LIMIT;
+        }
+    }
+    if (numa_nodes == 0)
+    {
+        // The main arena belongs to the node of the first thread using it.
+
+        HMMnuma_init();
+        main_arena.node = HMMcurrent_node();
+    }
+    int node = HMMcurrent_node();
+    if (node >= 0)
+    {
+        thread_arena = HMMnode_arena(contended, node);
+        pthread_mutex_unlock(&arenas_mutex);
+        return thread_arena;
+    }
+    size_t idx;
+    if (contended == NULL)
+    {
+        idx = arena_next++ % arena_max;
+    }
+    else
+    {
+        idx = (arena_count < arena_max) ? arena_count : (contended->index + 1) % arena_count;
+    }
+    if (idx >= arena_count)
+    {
+        idx = (HMMarena_create(-1) != NULL) ? arena_count - 1 : idx % arena_count;
+    }
+    thread_arena = arenas[idx];
+    pthread_mutex_unlock(&arenas_mutex);
+    return thread_arena;
+}
+/**
+ * @brief Locks the calling thread's arena, moving the thread if that arena is contended.
+ * 
+ * Blocks other threads handed back to the arena are freed before it is used.
+ * 
+ * @return Pointer to the locked arena, or NULL if locking failed.
+ */
+static hmm_arena_t *HMMarena_lock(void)
+{
+    hmm_arena_t *arena = thread_arena;
+    if (arena == NULL)
+    {
+        arena = HMMarena_assign(NULL);
+    }
+    HMMstat_add(STAT_LOCK_ACQUISITIONS, 1);
+    if (pthread_mutex_trylock(&arena->alloc_mutex) != 0)
+    {
+        HMMstat_add(STAT_LOCK_CONTENTIONS, 1);
+        arena = HMMarena_assign(arena);
+        if (pthread_mutex_lock(&arena->alloc_mutex) != 0)
+        {
+            return NULL;
+        }
+    }
+    HMMremote_drain(arena);
+    return arena;
+}
+/**
+ * @brief Allocates memory without going through the per-thread cache.
+ * 
+ * Requests of at least mmap_threshold bytes get their own mapping. Others are
+ * served by the calling thread's arena, taking its lock; requests too large for a
+ * segment get their own mapping whatever the threshold. Requests of up to
+ * TCACHE_MAX_SIZE always come from an arena, which HMMfree_sized_cached relies on.
+ * 
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMmalloc_uncached(size_t size)
+{
+    size_t request_size = HMMrequest_size(size);
+    if ((request_size > TCACHE_MAX_SIZE) && (request_size >= mmap_threshold))
+    {
+        void *mapped = HMMmmap_alloc(ALIGNMENT, request_size);
+        if (mapped)
+        {
+            return mapped;
+        }
+    }
+    hmm_arena_t *arena = HMMarena_lock();
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    void *ret_ptr = HMMmalloc(arena, size);
+    pthread_mutex_unlock(&arena->alloc_mutex);
+    if ((ret_ptr == NULL) && (request_size > TCACHE_MAX_SIZE) && (request_size < mmap_threshold))
+    {
+        ret_ptr = HMMmmap_alloc(ALIGNMENT, request_size);
+    }
+    return ret_ptr;
+}
+/**
+ * @brief Allocates zeroed memory for an array of elements, each with a specified size.
+ * 
+ * @param nmemb Number of elements.
+ * @param size Size of each element.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMcalloc(size_t nmemb, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total) || (total > PTRDIFF_MAX))
+    {
+        return NULL;
+    }
+    size = (total + (ALIGNMENT - 1)) & ~((size_t)ALIGNMENT - 1);
+    if (size == 0)
+        size = ALIGNMENT;
+    void *allocated_area = HMMmalloc_uncached(size);
+    if (allocated_area == NULL)
+    {
+        return NULL;
+    }
+    size_t clear_size = HMMusable_size(allocated_area);
+        // Chunks carved from zeroed memory (fresh segments and mappings) only need their links cleared.
+
+    if ((HMMsegment_for_address(allocated_area)->kind != SEGMENT_SLAB) && (HMMpayload_chunk(allocated_area)->size & CHUNK_ZEROED) && (clear_size > ZEROED_DIRTY_SIZE))
+    {
+        clear_size = ZEROED_DIRTY_SIZE;
+    }
+    memset(allocated_area, 0, clear_size);
+    return allocated_area;
+}
+/**
+ * @brief Frees chunks of a per-thread cache bin until it holds a given number of blocks.
+ * 
+ * Consecutive chunks of the thread's own arena are freed under a single lock
+ * acquisition; chunks of other arenas go to their remote-free stacks.
+ * 
+ * @param idx Cache bin index.
+ * @param keep Number of blocks left in the bin.
+ */
+static void HMMtcache_flush(size_t idx, size_t keep)
+{
+    hmm_arena_t *locked = NULL;
+    while (tcache.counts[idx] > keep)
+    {
+        tcache_entry_t *victim = tcache.entries[idx];
+        hmm_arena_t *arena = HMMarena_for_address(victim);
+        if (arena != thread_arena)
+        {
+            tcache.entries[idx] = victim->next;
+            tcache.counts[idx]--;
+            victim->key = NULL;
+            HMMremote_free(arena, victim);
+            continue;
+        }
+        if (arena != locked)
+        {
+            if (locked)
+            {
+                pthread_mutex_unlock(&locked->alloc_mutex);
+            }
+            if (HMMlock_arena(arena) != 0)
+            {
+                return;
+            }
+            locked = arena;
+        }
+        tcache.entries[idx] = victim->next;
+        tcache.counts[idx]--;
+        HMMfree(arena, victim);
+    }
+    if (locked)
+    {
+        pthread_mutex_unlock(&locked->alloc_mutex);
+    }
+}
+/**
+ * @brief Returns every block of the calling thread's cache to the heap.
+ * 
+ * Called as the tcache_key destructor when a thread exits; the cache is disabled
+ * afterwards so that later frees from other destructors go straight to the heap.
+ * 
+ * @param arg Unused.
+ */
+static void HMMtcache_destroy(void *arg)
+{
+    (void)arg;
+    tcache.state = TCACHE_DISABLED;
+    for (size_t idx = 0; idx < TCACHE_BINS; idx++)
+    {
+        HMMtcache_flush(idx, 0);
+    }
+}
+/**
+ * @brief Creates the key used to flush per-thread caches at thread exit.
+ */
+static void HMMtcache_key_init(void)
+{
+    tcache_keyed = (pthread_key_create(&tcache_key, HMMtcache_destroy) == 0);
+}
+/**
+ * @brief Checks whether the calling thread may use its cache, registering it on first use.
+ * 
+ * @return 1 if the cache is usable, 0 otherwise.
+ */
+static int HMMtcache_usable(void)
+{
+    if (tcache.state == TCACHE_UNINIT)
+    {
+        tcache.state = TCACHE_DISABLED;
+        HMMtunables_init();
+        pthread_once(&tcache_key_once, HMMtcache_key_init);
+        if (tcache_keyed && (pthread_setspecific(tcache_key, &tcache) == 0))
+        {
+            tcache.state = TCACHE_ACTIVE;
+        }
+    }
+    return (tcache.state == TCACHE_ACTIVE) && (__atomic_load_n(&tcache_count, __ATOMIC_RELAXED) != 0);
+}
+/**
+ * @brief Takes a block of a given payload size from the calling thread's cache.
+ * 
+ * An empty bin is refilled with half its capacity under a single lock of the thread's arena.
+ * 
+ * @param size Payload size (result of HMMrequest_size, at most TCACHE_MAX_SIZE).
+ * @return Pointer to the allocated memory, or NULL if the cache cannot serve the request.
+ */
+static void *HMMtcache_get(size_t size)
+{
+    if (!HMMtcache_usable())
+    {
+        return NULL;
+    }
+    size_t idx = (size >> ALIGNMENT_SHIFT) - 1;
+    if (tcache.entries[idx] == NULL)
+    {
+        // Refill the bin in one batch.
+
+        size_t batch = (__atomic_load_n(&tcache_count, __ATOMIC_RELAXED) + 1) / 2;
+        hmm_arena_t *arena = HMMarena_lock();
+        if (arena == NULL)
+        {
+            return NULL;
+        }
+        while (tcache.counts[idx] < batch)
+        {
+            tcache_entry_t *entry = HMMmalloc(arena, size);
+            if (entry == NULL)
+            {
+                break;
+            }
+            entry->next = tcache.entries[idx];
+            tcache.entries[idx] = entry;
+            tcache.counts[idx]++;
+        }
+        pthread_mutex_unlock(&arena->alloc_mutex);
+        if (tcache.entries[idx] == NULL)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        HMMstat_add(STAT_TCACHE_HITS, 1);
+    }
+    tcache_entry_t *entry = tcache.entries[idx];
+    tcache.entries[idx] = entry->next;
+    tcache.counts[idx]--;
+    entry->key = NULL;
+    return entry;
+}
+/**
+ * @brief Puts a freed block of a known size into the calling thread's cache.
+ * 
+ * A full bin first gives half of its blocks back to their arenas in one batch.
+ * Cached blocks stay allocated as far as their chunks and slabs are concerned.
+ * 
+ * @param ptr Pointer to the memory being freed, an allocated arena block.
+ * @param size Bin size: the usable size of the block, or less.
+ * @return 1 if the block was cached, 0 if it must be freed to the heap.
+ */
+static int HMMtcache_push(void *ptr, size_t size)
+{
+    if ((size > TCACHE_MAX_SIZE) || !HMMtcache_usable())
+    {
+        return 0;
+    }
+    size_t idx = (size >> ALIGNMENT_SHIFT) - 1;
+    tcache_entry_t *entry = ptr;
+        // The key marks cached blocks, so a double free does not cache a block twice.
+
+    if (entry->key == &tcache)
+    {
+        for (tcache_entry_t *cur = tcache.entries[idx]; cur; cur = cur->next)
+        {
+            if (cur == entry)
+            {
+                return 1;
+            }
+        }
+    }
+    size_t count = __atomic_load_n(&tcache_count, __ATOMIC_RELAXED);
+    if (tcache.counts[idx] >= count)
+    {
+        // Flush half of the bin in one batch.
+
+        HMMtcache_flush(idx, count / 2);
+    }
+    entry->next = tcache.entries[idx];
+    entry->key = &tcache;
+    tcache.entries[idx] = entry;
+    tcache.counts[idx]++;
+    return 1;
+}
+/**
+ * @brief Puts a freed block into the calling thread's cache, reading its size from its metadata.
+ * 
+ * @param ptr Pointer to the memory being freed.
+ * @return 1 if the block was cached, 0 if it must be freed to the heap.
+ */
+static int HMMtcache_put(void *ptr)
+{
+    hmm_segment_t *segment = HMMsegment_for_address(ptr);
+    size_t size;
+    if (segment->kind == SEGMENT_SLAB)
+    {
+        size = HMMslab_for_object(ptr)->object_size;
+    }
+    else
+    {
+        mem_chunk_t *chunk = HMMpayload_chunk(ptr);
+        if ((segment->kind == SEGMENT_MMAP) || (chunk->size & CHUNK_FREE))
+        {
+            return 0;
+        }
+        size = HMMchunk_size(chunk);
+    }
+    return HMMtcache_push(ptr, size);
+}
+/**
+ * @brief Computes the natural logarithm of a number in (0, 1] without libm.
+ * 
+ * @param x Number to take the logarithm of.
+ * @return ln(x).
+ */
+static double HMMprofile_log(double x)
+{
+    int exponent = 0;
+    while (x < 1.0)
+    {
+        x *= 2.0;
+        exponent--;
+    }
+        // ln(x) = 2 atanh((x - 1) / (x + 1)), whose series converges quickly for x in [1, 2).
+
+    double t = (x - 1.0) / (x + 1.0);
+    double t2 = t * t;
+    double series = 2.0 * t * (1.0 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 * (1.0 / 9 + t2 / 11)))));
+    return exponent * 0.6931471805599453 + series;
+}
+/**
+ * @brief Draws the number of bytes the calling thread allocates before its next sample.
+ * 
+ * Intervals are exponentially distributed with mean sample_interval, so every
+ * allocated byte has the same chance of being sampled whatever the allocation pattern.
+ * 
+ * @return Bytes until the next sample, at least 1.
+ */
+static int64_t HMMprofile_interval(void)
+{
+    sampler.rng ^= sampler.rng << 13;
+    sampler.rng ^= sampler.rng >> 7;
+    sampler.rng ^= sampler.rng << 17;
+    double uniform = ((sampler.rng >> 11) + 1) * 0x1p-53;
+    double interval = -HMMprofile_log(uniform) * __atomic_load_n(&sample_interval, __ATOMIC_RELAXED);
+    return (interval < (double)INT64_MAX / 2) ? (int64_t)interval + 1 : INT64_MAX / 2;
+}
+/**
+ * @brief Returns the profile_samples index of a block.
+ * 
+ * @param ptr Address of the block.
+ * @return Hash table index.
+ */
+static size_t HMMprofile_index(void *ptr)
+{
+    return (size_t)((((uintptr_t)ptr >> ALIGNMENT_SHIFT) * 0x9e3779b97f4a7c15ull) >> 32) & (PROFILE_TABLE_SIZE - 1);
+}
+/**
+ * @brief Carves memory for profiler records from mappings of its own.
+ * 
+ * Records never go through malloc, so the profiler neither recurses into itself nor
+ * shows up in its own profile. Bucket memory is never given back.
+ * 
+ * @param size Size of the record (a multiple of sizeof(void *)).
+ * @return Pointer to the record, NULL if mapping failed.
+ */
+static void *HMMprofile_carve(size_t size)
+{
+    if (profile_pool_left < size)
+    {
+        void *pool = mmap(NULL, PROFILE_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        HMMstat_add(STAT_MMAP_CALLS, 1);
+        if (pool == MAP_FAILED)
+        {
+            return NULL;
+        }
+        profile_pool = pool;
+        profile_pool_left = PROFILE_POOL_SIZE;
+    }
+    void *record = profile_pool;
+    profile_pool += size;
+    profile_pool_left -= size;
+    return record;
+}
+/**
+ * @brief Counts an allocation towards the next sample, recording its call stack when it is sampled.
+ * 
+ * Only called while sampling is on. Kept out of line so the malloc wrappers stay
+ * small and the number of allocator frames on the stack is fixed.
+ * 
+ * @param ptr Address of the allocated block.
+ * @param size Size requested for the block.
+ */
+static __attribute__((noinline)) void HMMprofile_malloc(void *ptr, size_t size)
+{
+    if (sampler.busy)
+    {
+        return;
+    }
+    if (sampler.countdown == 0)
+    {
+        sampler.rng = ((uintptr_t)&sampler | 1) * 0x9e3779b97f4a7c15ull;
+        sampler.countdown = HMMprofile_interval();
+    }
+    sampler.countdown -= (size < INT64_MAX / 2) ? (int64_t)size : INT64_MAX / 2;
+    if (sampler.countdown > 0)
+    {
+        return;
+    }
+    sampler.countdown = HMMprofile_interval();
+        // backtrace may allocate the first time it runs: those allocations are not sampled.
+
+    sampler.busy = 1;
+    void *frames[PROFILE_DEPTH + PROFILE_SKIP];
+    int frame_count = backtrace(frames, PROFILE_DEPTH + PROFILE_SKIP);
+    size_t depth = (frame_count > PROFILE_SKIP) ? (size_t)frame_count - PROFILE_SKIP : 0;
+    void **stack = frames + PROFILE_SKIP;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3ull;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    hmm_profile_bucket_t **head = &profile_buckets[hash & (PROFILE_TABLE_SIZE - 1)];
+    hmm_profile_bucket_t *bucket = *head;
+    while (bucket && ((bucket->hash != hash) || (bucket->depth != depth) || (memcmp(bucket->stack, stack, depth * sizeof(void *)) != 0)))
+    {
+        bucket = bucket->next;
+    }
+    if (bucket == NULL)
+    {
+        bucket = HMMprofile_carve(sizeof(hmm_profile_bucket_t));
+        if (bucket)
+        {
+            memset(bucket, 0, sizeof(*bucket));
+            bucket->hash = hash;
+            bucket->depth = depth;
+            memcpy(bucket->stack, stack, depth * sizeof(void *));
+            bucket->next = *head;
+            *head = bucket;
+        }
+    }
+    hmm_profile_sample_t *sample = profile_free_samples;
+    if (sample)
+    {
+        profile_free_samples = sample->next;
+    }
+    else if (bucket)
+    {
+        sample = HMMprofile_carve(sizeof(hmm_profile_sample_t));
+    }
+    if (bucket && sample)
+    {
+        bucket->allocs++;
+        bucket->alloc_bytes += size;
+        size_t index = HMMprofile_index(ptr);
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->bucket = bucket;
+        sample->next = profile_samples[index];
+        __atomic_store_n(&profile_samples[index], sample, __ATOMIC_RELAXED);
+        __atomic_store_n(&profile_live, profile_live + 1, __ATOMIC_RELAXED);
+    }
+    else if (sample)
+    {
+        sample->next = profile_free_samples;
+        profile_free_samples = sample;
+    }
+    pthread_mutex_unlock(&profile_mutex);
+    sampler.busy = 0;
+}
+/**
+ * @brief Stops tracking a block if it was sampled, counting it as freed in its bucket.
+ * 
+ * Only called while some samples are tracked. An empty hash table slot, the common
+ * case, is detected without taking profile_mutex.
+ * 
+ * @param ptr Address of the block being freed or moved.
+ */
+static void HMMprofile_free(void *ptr)
+{
+    size_t index = HMMprofile_index(ptr);
+    if (__atomic_load_n(&profile_samples[index], __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    for (hmm_profile_sample_t **link = &profile_samples[index]; *link; link = &(*link)->next)
+    {
+        hmm_profile_sample_t *sample = *link;
+        if (sample->ptr == ptr)
+        {
+            __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+            sample->bucket->frees++;
+            sample->bucket->free_bytes += sample->size;
+            sample->next = profile_free_samples;
+            profile_free_samples = sample;
+            __atomic_store_n(&profile_live, profile_live - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+/**
+ * @brief Allocates memory, from the per-thread cache when it holds a block of the right size.
+ * 
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMmalloc_cached(size_t size)
+{
+    size_t request_size = HMMrequest_size(size);
+    if ((request_size != 0) && (request_size <= TCACHE_MAX_SIZE))
+    {
+        void *cached = HMMtcache_get(request_size);
+        if (cached)
+        {
+            return cached;
+        }
+    }
+    return HMMmalloc_uncached(size);
+}
+/**
+ * @brief Frees memory to its mapping or arena, without going through the per-thread cache.
+ * 
+ * @param ptr Pointer to the memory to be freed (not NULL).
+ */
+static void HMMfree_uncached(void *ptr)
+{
+    hmm_segment_t *segment = HMMsegment_for_address(ptr);
+    if (segment->kind == SEGMENT_MMAP)
+    {
+        HMMmmap_free(segment);
+        return;
+    }
+    hmm_arena_t *arena = segment->arena;
+    if (arena != thread_arena)
+    {
+        // Blocks of other arenas go back to their owner without taking its lock.
+
+        HMMremote_free(arena, ptr);
+        return;
+    }
+    if (HMMlock_arena(arena) != 0)
+    {
+        return;
+    }
+    HMMfree(arena, ptr);
+    pthread_mutex_unlock(&arena->alloc_mutex);
+}
+/**
+ * @brief Frees memory, into the per-thread cache when it has room for the block.
+ * 
+ * @param ptr Pointer to the memory to be freed (not NULL).
+ */
+static void HMMfree_cached(void *ptr)
+{
+    if (HMMtcache_put(ptr))
+    {
+        return;
+    }
+    HMMfree_uncached(ptr);
+}
+/**
+ * @brief Frees memory whose size the caller knows.
+ * 
+ * Blocks of up to TCACHE_MAX_SIZE never get their own mapping, so such a block is
+ * an arena block whatever it is, and goes into the per-thread cache bin of the given
+ * size without its segment, slab or chunk header being read. A block too large for
+ * the cache skips the cache lookup altogether.
+ * 
+ * @param ptr Pointer to the memory to be freed (not NULL).
+ * @param size Size requested when the block was allocated (or last resized).
+ */
+static void HMMfree_sized_cached(void *ptr, size_t size)
+{
+    size_t request_size = HMMrequest_size(size);
+    if ((request_size != 0) && HMMtcache_push(ptr, request_size))
+    {
+        return;
+    }
+    HMMfree_uncached(ptr);
+}
+/**
+ * @brief Wrapper function for thread-safe memory allocation.
+ * 
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+void *malloc(size_t size)
+{
+    HMMstat_add(STAT_MALLOC_CALLS, 1);
+    void *ptr = HMMmalloc_cached(size);
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && ptr)
+    {
+        HMMprofile_malloc(ptr, size);
+    }
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+/**
+ * @brief Wrapper function for thread-safe memory deallocation.
+ * 
+ * @param ptr Pointer to the memory to be freed.
+ */
+void free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    HMMstat_add(STAT_FREE_CALLS, 1);
+    if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0))
+    {
+        HMMprofile_free(ptr);
+    }
+    HMMfree_cached(ptr);
+}
+/**
+ * @brief Wrapper function for thread-safe C23 sized deallocation.
+ * 
+ * @param ptr Pointer to the memory to be freed.
+ * @param size Size passed to the malloc, calloc (nmemb * size) or realloc call that returned ptr.
+ */
+void free_sized(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    HMMstat_add(STAT_FREE_CALLS, 1);
+    if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0))
+    {
+        HMMprofile_free(ptr);
+    }
+    HMMfree_sized_cached(ptr, size);
+}
+/**
+ * @brief Wrapper function for thread-safe C23 sized deallocation of aligned memory.
+ * 
+ * Blocks aligned beyond ALIGNMENT are chunks, never slab objects, so only the
+ * size of the others can skip the metadata lookup.
+ * 
+ * @param ptr Pointer to the memory to be freed.
+ * @param alignment Alignment passed to the aligned_alloc call that returned ptr.
+ * @param size Size passed to that call.
+ */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    HMMstat_add(STAT_FREE_CALLS, 1);
+    if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0))
+    {
+        HMMprofile_free(ptr);
+    }
+    if (alignment <= ALIGNMENT)
+    {
+        HMMfree_sized_cached(ptr, size);
+    }
+    else
+    {
+        HMMfree_cached(ptr);
+    }
+}
+/**
+ * @brief Returns the number of usable bytes of an allocated block.
+ * 
+ * @param ptr Pointer to an allocated block, or NULL.
+ * @return Usable size, read from the chunk header or slab header; 0 for NULL.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    return HMMusable_size(ptr);
+}
+/**
+ * @brief Allocates zeroed memory, from the per-thread cache when it holds a block of the right size.
+ * 
+ * @param nmemb Number of elements.
+ * @param size Size of each element.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMcalloc_cached(size_t nmemb, size_t size)
+{
+    if ((size != 0) && (nmemb <= (SIZE_MAX / size)))
+    {
+        size_t request_size = HMMrequest_size(nmemb * size);
+        if ((request_size != 0) && (request_size <= TCACHE_MAX_SIZE))
+        {
+            void *cached = HMMtcache_get(request_size);
+            if (cached)
+            {
+                memset(cached, 0, request_size);
+                return cached;
+            }
+        }
+    }
+    return HMMcalloc(nmemb, size);
+}
+/**
+ * @brief Wrapper function for thread-safe calloc.
+ * 
+ * @param nmemb Number of elements.
+ * @param size Size of each element.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    HMMstat_add(STAT_CALLOC_CALLS, 1);
+    void *ptr = HMMcalloc_cached(nmemb, size);
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && ptr)
+    {
+        HMMprofile_malloc(ptr, nmemb * size);
+    }
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+/**
+ * @brief Resizes a block, in place when possible, otherwise moving it.
+ * 
+ * @param ptr Pointer to the previously allocated memory block.
+ * @param size New size for the memory block.
+ * @return Pointer to the reallocated memory block if successful, NULL otherwise.
+ */
+static void *HMMrealloc_cached(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return HMMmalloc_cached(size);
+    }
+    hmm_segment_t *segment = HMMsegment_for_address(ptr);
+    size_t request_size = HMMrequest_size(size);
+    if (request_size == 0)
+    {
+        return NULL;
+    }
+    if ((segment->kind == SEGMENT_MMAP) || (request_size >= mmap_threshold))
+    {
+        // Mapped blocks are remapped while they stay above the threshold or shrink
+        // by less than half, and stay too large for the per-thread cache; otherwise
+        // the block moves to where malloc puts a block of the new size.
+
+        size_t old_size = HMMusable_size(ptr);
+        if ((segment->kind == SEGMENT_MMAP) && (request_size > TCACHE_MAX_SIZE) &&
+            ((request_size >= mmap_threshold) || ((request_size <= old_size) && (request_size >= old_size / 2))))
+        {
+            void *remapped = HMMmmap_realloc(ptr, request_size);
+            if (remapped)
+            {
+                return remapped;
+            }
+        }
+        if (size == 0)
+        {
+            HMMfree_cached(ptr);
+            return HMMmalloc_cached(0);
+        }
+        void *moved = HMMmalloc_cached(size);
+        if (moved)
+        {
+            memcpy(moved, ptr, (old_size < size) ? old_size : size);
+            HMMfree_cached(ptr);
+        }
+        return moved;
+    }
+        // Resize inside the arena owning the block.
+
+    hmm_arena_t *arena = segment->arena;
+    if (HMMlock_arena(arena) != 0)
+    {
+        return NULL;
+    }
+    void *ret_ptr = HMMrealloc(arena, ptr, size);
+    pthread_mutex_unlock(&arena->alloc_mutex);
+    if ((ret_ptr == NULL) && (size != 0))
+    {
+        // The block cannot grow inside its segment: move it through malloc.
+
+        ret_ptr = HMMmalloc_cached(size);
+        if (ret_ptr)
+        {
+            size_t old_size = HMMusable_size(ptr);
+            memcpy(ret_ptr, ptr, (old_size < size) ? old_size : size);
+            HMMfree_cached(ptr);
+        }
+    }
+    return ret_ptr;
+}
+/**
+ * @brief Wrapper function for thread-safe realloc.
+ * 
+ * A sampled block is counted as freed, and the resized block may be sampled anew.
+ * 
+ * @param ptr Pointer to the previously allocated memory block.
+ * @param size New size for the memory block.
+ * @return Pointer to the reallocated memory block if successful, NULL otherwise.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    HMMstat_add(STAT_REALLOC_CALLS, 1);
+    void *resized = HMMrealloc_cached(ptr, size);
+        // Untrack the old block only once it is gone, so a failed resize keeps its sample.
+
+    if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0) && ptr && (resized || (size == 0)))
+    {
+        HMMprofile_free(ptr);
+    }
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && resized)
+    {
+        HMMprofile_malloc(resized, size);
+    }
+    if (resized == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return resized;
+}
+/**
+ * @brief Wrapper function for thread-safe realloc of an array, failing on overflow.
+ * 
+ * @param ptr Pointer to the previously allocated memory block.
+ * @param nmemb Number of elements.
+ * @param size Size of each element.
+ * @return Pointer to the reallocated memory block if successful, NULL otherwise.
+ */
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    HMMstat_add(STAT_REALLOC_CALLS, 1);
+    if ((size != 0) && (nmemb > SIZE_MAX / size))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *resized = HMMrealloc_cached(ptr, nmemb * size);
+        // Untrack the old block only once it is gone, so a failed resize keeps its sample.
+
+    if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0) && ptr && (resized || (nmemb * size == 0)))
+    {
+        HMMprofile_free(ptr);
+    }
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && resized)
+    {
+        HMMprofile_malloc(resized, nmemb * size);
+    }
+    if (resized == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return resized;
+}
+/**
+ * @brief Allocates memory aligned to a power of two.
+ * 
+ * Alignments up to ALIGNMENT are those of malloc. Larger ones are carved from the
+ * calling thread's arena, or get their own mapping from mmap_threshold bytes on or
+ * when the arena cannot serve them.
+ * 
+ * @param alignment Power of two.
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+static void *HMMaligned_cached(size_t alignment, size_t size)
+{
+    if (alignment <= ALIGNMENT)
+    {
+        return HMMmalloc_cached(size);
+    }
+    size_t request_size = HMMrequest_size(size);
+    if ((request_size == 0) || (alignment > MAX_ALIGNMENT))
+    {
+        return NULL;
+    }
+    void *ret_ptr = NULL;
+    if (request_size + alignment < mmap_threshold)
+    {
+        hmm_arena_t *arena = HMMarena_lock();
+        if (arena == NULL)
+        {
+            return NULL;
+        }
+        ret_ptr = HMMmemalign(arena, alignment, request_size);
+        pthread_mutex_unlock(&arena->alloc_mutex);
+    }
+    if (ret_ptr == NULL)
+    {
+        ret_ptr = HMMmmap_alloc(alignment, request_size);
+    }
+    return ret_ptr;
+}
+/**
+ * @brief Wrapper function for thread-safe POSIX aligned allocation.
+ * 
+ * @param memptr Output: pointer to the allocated memory.
+ * @param alignment Power of two, multiple of sizeof(void *).
+ * @param size Size of the memory to allocate.
+ * @return 0 on success, EINVAL for an invalid alignment or one above MAX_ALIGNMENT, ENOMEM if allocation failed.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    HMMstat_add(STAT_MALLOC_CALLS, 1);
+    if ((alignment % sizeof(void *) != 0) || (alignment & (alignment - 1)) || (alignment == 0) || (alignment > MAX_ALIGNMENT))
+    {
+        return EINVAL;
+    }
+    void *ptr = HMMaligned_cached(alignment, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0))
+    {
+        HMMprofile_malloc(ptr, size);
+    }
+    *memptr = ptr;
+    return 0;
+}
+/**
+ * @brief Wrapper function for thread-safe C11 aligned allocation.
+ * 
+ * @param alignment Power of two.
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise (errno is EINVAL for an invalid alignment or one above MAX_ALIGNMENT).
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    HMMstat_add(STAT_MALLOC_CALLS, 1);
+    if ((alignment & (alignment - 1)) || (alignment == 0) || (alignment > MAX_ALIGNMENT))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    void *ptr = HMMaligned_cached(alignment, size);
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && ptr)
+    {
+        HMMprofile_malloc(ptr, size);
+    }
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+/**
+ * @brief Wrapper function for thread-safe memalign.
+ * 
+ * As in glibc, an alignment that is not a power of two is rounded up to one.
+ * 
+ * @param alignment Requested alignment.
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise (errno is EINVAL for an alignment above MAX_ALIGNMENT).
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    HMMstat_add(STAT_MALLOC_CALLS, 1);
+    if (alignment > MAX_ALIGNMENT)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment & (alignment - 1))
+    {
+        alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+    }
+    void *ptr = HMMaligned_cached(alignment, size);
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && ptr)
+    {
+        HMMprofile_malloc(ptr, size);
+    }
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+/**
+ * @brief Wrapper function for thread-safe page-aligned allocation.
+ * 
+ * @param size Size of the memory to allocate.
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+void *valloc(size_t size)
+{
+    HMMstat_add(STAT_MALLOC_CALLS, 1);
+    void *ptr = HMMaligned_cached(sysconf(_SC_PAGESIZE), size);
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && ptr)
+    {
+        HMMprofile_malloc(ptr, size);
+    }
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+/**
+ * @brief Wrapper function for thread-safe page-aligned allocation of whole pages.
+ * 
+ * @param size Size of the memory to allocate, rounded up to a multiple of the page size (one page for 0).
+ * @return Pointer to the allocated memory if successful, NULL otherwise.
+ */
+void *pvalloc(size_t size)
+{
+    HMMstat_add(STAT_MALLOC_CALLS, 1);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page_size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = (size == 0) ? page_size : ((size + page_size - 1) & ~(page_size - 1));
+    void *ptr = HMMaligned_cached(page_size, size);
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0) && ptr)
+    {
+        HMMprofile_malloc(ptr, size);
+    }
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+/**
+ * @brief Wrapper function allocating a batch of blocks of the same size.
+ * 
+ * The calling thread's arena is locked once for the whole batch; blocks it cannot
+ * serve, and blocks large enough for their own mapping, are allocated one by one.
+ * 
+ * @param size Size of each block.
+ * @param n Number of blocks.
+ * @param out Output: the blocks allocated, in its first entries.
+ * @return Number of blocks allocated, less than n if memory ran out.
+ */
+size_t hmm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t request_size = HMMrequest_size(size);
+    size_t done = 0;
+    if ((request_size != 0) && (request_size < mmap_threshold))
+    {
+        hmm_arena_t *arena = HMMarena_lock();
+        if (arena)
+        {
+            done = HMMmalloc_batch(arena, size, n, out);
+            pthread_mutex_unlock(&arena->alloc_mutex);
+        }
+    }
+    while ((done < n) && ((out[done] = HMMmalloc_uncached(size)) != NULL))
+    {
+        done++;
+    }
+    HMMstat_add(STAT_MALLOC_CALLS, done);
+    if (__builtin_expect(__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) != 0, 0))
+    {
+        for (size_t i = 0; i < done; i++)
+        {
+            HMMprofile_malloc(out[i], size);
+        }
+    }
+    return done;
+}
+/**
+ * @brief Moves an entry of a max-heap of pointers down until its children are smaller.
+ * 
+ * @param ptrs Heap array.
+ * @param root Index of the entry to move.
+ * @param end Number of entries in the heap.
+ */
+static void HMMsift_pointer(void **ptrs, size_t root, size_t end)
+{
+    while (2 * root + 1 < end)
+    {
+        size_t child = 2 * root + 1;
+        if ((child + 1 < end) && ((uintptr_t)ptrs[child] < (uintptr_t)ptrs[child + 1]))
+        {
+            child++;
+        }
+        if ((uintptr_t)ptrs[root] >= (uintptr_t)ptrs[child])
+        {
+            return;
+        }
+        void *tmp = ptrs[root];
+        ptrs[root] = ptrs[child];
+        ptrs[child] = tmp;
+        root = child;
+    }
+}
+/**
+ * @brief Sorts an array of pointers by address, in place and without allocating (heapsort).
+ * 
+ * @param ptrs Array to sort.
+ * @param n Number of entries.
+ */
+static void HMMsort_pointers(void **ptrs, size_t n)
+{
+    for (size_t start = n / 2; start-- > 0;)
+    {
+        HMMsift_pointer(ptrs, start, n);
+    }
+    for (size_t end = n; end > 1; end--)
+    {
+        void *top = ptrs[0];
+        ptrs[0] = ptrs[end - 1];
+        ptrs[end - 1] = top;
+        HMMsift_pointer(ptrs, 0, end - 1);
+    }
+}
+/**
+ * @brief Wrapper function freeing a batch of blocks.
+ * 
+ * The blocks are sorted by address, so each arena is locked once per stretch of its
+ * blocks, and blocks of the batch that are physical neighbours are folded into one
+ * chunk that is freed and coalesced once. The blocks bypass the per-thread cache.
+ * 
+ * @param ptrs Blocks to free; NULL entries are skipped. The array is reordered.
+ * @param n Number of entries.
+ */
+void hmm_free_batch(void **ptrs, size_t n)
+{
+        // Sort, then keep each block once.
+
+    HMMsort_pointers(ptrs, n);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if ((ptrs[i] != NULL) && ((count == 0) || (ptrs[i] != ptrs[count - 1])))
+        {
+            ptrs[count++] = ptrs[i];
+        }
+    }
+    HMMstat_add(STAT_FREE_CALLS, count);
+    if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            HMMprofile_free(ptrs[i]);
+        }
+    }
+    hmm_arena_t *locked = NULL;
+    for (size_t i = 0; i < count; i++)
+    {
+        void *ptr = ptrs[i];
+        hmm_segment_t *segment = HMMsegment_for_address(ptr);
+        if (segment->kind == SEGMENT_MMAP)
+        {
+            HMMmmap_free(segment);
+            continue;
+        }
+        if (segment->arena != locked)
+        {
+            if (locked)
+            {
+                pthread_mutex_unlock(&locked->alloc_mutex);
+            }
+            locked = (HMMlock_arena(segment->arena) == 0) ? segment->arena : NULL;
+            if (locked == NULL)
+            {
+                continue;
+            }
+        }
+        mem_chunk_t *chunk = HMMpayload_chunk(ptr);
+        if ((segment->kind == SEGMENT_HEAP) && !(chunk->size & CHUNK_FREE))
+        {
+            // Absorb the following blocks of the batch while they are allocated neighbours.
+
+            mem_chunk_t *next = HMMnext_chunk(chunk);
+            while ((i + 1 < count) && (ptrs[i + 1] == (unsigned char *)next + CHUNK_HEADER_SIZE) && !(next->size & CHUNK_FREE))
+            {
+                HMMset_chunk_size(chunk, HMMchunk_size(chunk) + CHUNK_HEADER_SIZE + HMMchunk_size(next));
+                next = HMMnext_chunk(chunk);
+                i++;
+            }
+        }
+        HMMfree(locked, ptr);
+    }
+    if (locked)
+    {
+        pthread_mutex_unlock(&locked->alloc_mutex);
+    }
+}
+/**
+ * @brief Prints information about each chunk between a segment's first chunk and its fencepost.
+ * 
+ * @param cur Pointer to the first chunk.
+ * @param end Pointer to the fencepost.
+ * @param cnt Number of the first chunk.
+ * @return Number following the last printed chunk.
+ */
+static size_t HMMtraverse_segment(mem_chunk_t *cur, mem_chunk_t *end, size_t cnt)
+{
+    while (cur && (cur != end))
+    {
+        printf("Node number: %zu, Address: %10p, free: %u, size: %zu\r\n", cnt, (void *)cur, (unsigned int)(cur->size & CHUNK_FREE), HMMchunk_size(cur));
+        cnt++;
+        cur = HMMnext_chunk(cur);
+    }
+    return cnt;
+}
+/**
+ * @brief Traverses the memory chunks of every arena and prints information about each chunk.
+ */
+void HMMtraverse(void)
+{
+    for (size_t i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++)
+    {
+        hmm_arena_t *arena = arenas[i];
+        pthread_mutex_lock(&arena->alloc_mutex);
+        HMMremote_drain(arena);
+        printf("Arena number: %zu\r\n", i);
+        size_t cnt = 1;
+        for (hmm_segment_t *segment = arena->segments; segment; segment = segment->next)
+        {
+            cnt = HMMtraverse_segment(HMMsegment_first_chunk(segment), segment->tail, cnt);
+        }
+        for (hmm_segment_t *segment = arena->slab_segments; segment; segment = segment->next)
+        {
+            for (size_t offset = SLAB_SIZE; offset < segment->carved; offset += SLAB_SIZE)
+            {
+                hmm_slab_t *slab = (hmm_slab_t *)((unsigned char *)segment + offset);
+                if (HMMslab_purged_map(segment)[offset / SLAB_SIZE / 64] & ((uint64_t)1 << (offset / SLAB_SIZE % 64)))
+                {
+                    continue;
+                }
+                printf("Slab address: %10p, object size: %u, used: %u/%u\r\n", (void *)slab, slab->object_size, slab->used, slab->capacity);
+            }
+        }
+        pthread_mutex_unlock(&arena->alloc_mutex);
+    }
+}
+/**
+ * @brief Returns the hmm_stats_t size class of a block.
+ * 
+ * @param size Usable size of the block.
+ * @return Index i such that size lies in [2^i, 2^(i+1)).
+ */
+static size_t HMMsize_class(size_t size)
+{
+    return 63 - __builtin_clzll(size | 1);
+}
+/**
+ * @brief Returns the bytes malloc_trim(0) would give back to the system for a free chunk.
+ * 
+ * @param segment Segment holding the chunk.
+ * @param chunk Free chunk.
+ * @return The mapping past the chunk's header when it ends its segment, the whole
+ *         pages of its payload not purged yet otherwise.
+ */
+static size_t HMMreleasable_size(hmm_segment_t *segment, mem_chunk_t *chunk)
+{
+    size_t granule = HMMrelease_granule();
+    if (HMMnext_chunk(chunk) == segment->tail)
+    {
+        if (chunk == HMMsegment_first_chunk(segment))
+        {
+            return segment->size;
+        }
+        size_t used = ((unsigned char *)chunk + CHUNK_HEADER_SIZE - (unsigned char *)segment + granule - 1) & ~(granule - 1);
+        return (used < segment->size) ? segment->size - used : 0;
+    }
+    if (chunk->size & CHUNK_ZEROED)
+    {
+        return 0;
+    }
+    uintptr_t first_page = ((uintptr_t)chunk + CHUNK_HEADER_SIZE + ZEROED_DIRTY_SIZE + granule - 1) & ~((uintptr_t)granule - 1);
+    uintptr_t last_page = (uintptr_t)HMMnext_chunk(chunk) & ~((uintptr_t)granule - 1);
+    return (first_page < last_page) ? last_page - first_page : 0;
+}
+/**
+ * @brief Adds the chunks and slabs of an arena to a statistics snapshot.
+ * 
+ * @param arena Arena to walk (locked by the caller).
+ * @param stats Snapshot being filled.
+ */
+static void HMMarena_stats(hmm_arena_t *arena, hmm_stats_t *stats)
+{
+    for (hmm_segment_t *segment = arena->segments; segment; segment = segment->next)
+    {
+        stats->bytes_mapped += segment->size;
+        for (mem_chunk_t *cur = HMMsegment_first_chunk(segment); cur != segment->tail; cur = HMMnext_chunk(cur))
+        {
+            size_t size = HMMchunk_size(cur);
+            if (cur->size & CHUNK_FREE)
+            {
+                stats->chunks_free[HMMsize_class(size)]++;
+                stats->bytes_free += size;
+                stats->bytes_releasable += HMMreleasable_size(segment, cur);
+            }
+            else
+            {
+                stats->chunks_in_use[HMMsize_class(size)]++;
+                stats->bytes_in_use += size;
+            }
+        }
+    }
+    for (hmm_segment_t *segment = arena->slab_segments; segment; segment = segment->next)
+    {
+        stats->bytes_mapped += segment->size;
+        for (size_t offset = SLAB_SIZE; offset < segment->carved; offset += SLAB_SIZE)
+        {
+            hmm_slab_t *slab = (hmm_slab_t *)((unsigned char *)segment + offset);
+            size_t size_class = HMMsize_class(slab->object_size);
+            size_t unused = slab->capacity - slab->used;
+            stats->chunks_in_use[size_class] += slab->used;
+            stats->chunks_free[size_class] += unused;
+            stats->bytes_in_use += (size_t)slab->used * slab->object_size;
+            stats->bytes_free += unused * slab->object_size;
+            stats->slab_bytes_free += unused * slab->object_size;
+            stats->slab_objects_free += unused;
+            if ((slab->used == 0) && (slab->capacity != 0) && !__atomic_load_n(&huge_pages, __ATOMIC_RELAXED))
+            {
+                stats->bytes_releasable += SLAB_SIZE;
+            }
+        }
+    }
+}
+/**
+ * @brief Fills a snapshot of the allocator's statistics.
+ * 
+ * Arenas are walked one at a time under their own lock, then the counters of the
+ * running threads are summed with those of the exited ones under stats_mutex.
+ * 
+ * @param stats Structure to fill.
+ */
+void hmm_stats(hmm_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->arenas = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < stats->arenas; i++)
+    {
+        hmm_arena_t *arena = arenas[i];
+        if (HMMlock_arena(arena) != 0)
+        {
+            continue;
+        }
+        HMMremote_drain(arena);
+        HMMarena_stats(arena, stats);
+        pthread_mutex_unlock(&arena->alloc_mutex);
+    }
+    size_t counters[STAT_COUNT];
+    pthread_mutex_lock(&stats_mutex);
+    for (size_t i = 0; i < STAT_COUNT; i++)
+    {
+        counters[i] = __atomic_load_n(&stats_retired[i], __ATOMIC_RELAXED);
+        for (hmm_thread_stats_t *thread = stats_threads; thread; thread = thread->next)
+        {
+            counters[i] += __atomic_load_n(&thread->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    stats->mmap_chunks = counters[STAT_MMAP_CHUNKS];
+    stats->mmap_bytes = counters[STAT_MMAP_BYTES];
+    stats->bytes_mapped += stats->mmap_bytes;
+    stats->malloc_calls = counters[STAT_MALLOC_CALLS];
+    stats->free_calls = counters[STAT_FREE_CALLS];
+    stats->calloc_calls = counters[STAT_CALLOC_CALLS];
+    stats->realloc_calls = counters[STAT_REALLOC_CALLS];
+    stats->tcache_hits = counters[STAT_TCACHE_HITS];
+    stats->mmap_calls = counters[STAT_MMAP_CALLS];
+    stats->munmap_calls = counters[STAT_MUNMAP_CALLS];
+    stats->mprotect_calls = counters[STAT_MPROTECT_CALLS];
+    stats->mremap_calls = counters[STAT_MREMAP_CALLS];
+    stats->trim_events = counters[STAT_TRIM_EVENTS];
+    stats->trimmed_bytes = counters[STAT_TRIMMED_BYTES];
+    stats->madvise_calls = counters[STAT_MADVISE_CALLS];
+    stats->purged_bytes = counters[STAT_PURGED_BYTES];
+    stats->lock_acquisitions = counters[STAT_LOCK_ACQUISITIONS];
+    stats->lock_contentions = counters[STAT_LOCK_CONTENTIONS];
+}
+/**
+ * @brief Returns the allocator's statistics in the layout of glibc's mallinfo2.
+ * 
+ * @return The statistics.
+ */
+struct hmm_mallinfo hmm_mallinfo(void)
+{
+    hmm_stats_t stats;
+    hmm_stats(&stats);
+    struct hmm_mallinfo info = {0};
+    for (size_t i = 0; i < HMM_SIZE_CLASSES; i++)
+    {
+        info.ordblks += stats.chunks_free[i];
+    }
+    info.ordblks -= stats.slab_objects_free;
+    info.arena = stats.bytes_mapped - stats.mmap_bytes;
+    info.smblks = stats.slab_objects_free;
+    info.hblks = stats.mmap_chunks;
+    info.hblkhd = stats.mmap_bytes;
+    info.fsmblks = stats.slab_bytes_free;
+    info.uordblks = stats.bytes_in_use;
+    info.fordblks = stats.bytes_free;
+    info.keepcost = stats.bytes_releasable;
+    return info;
+}
+/**
+ * @brief Turns allocation sampling on or off.
+ * 
+ * @param bytes Mean number of bytes allocated between two samples, 0 to stop sampling.
+ */
+void hmm_set_sample_interval(size_t bytes)
+{
+    if (bytes != 0)
+    {
+        // Let backtrace load what it needs now rather than inside the first sample.
+
+        void *frame;
+        sampler.busy = 1;
+        backtrace(&frame, 1);
+        sampler.busy = 0;
+        pthread_mutex_lock(&profile_mutex);
+        profile_period = bytes;
+        pthread_mutex_unlock(&profile_mutex);
+    }
+    __atomic_store_n(&sample_interval, bytes, __ATOMIC_RELAXED);
+}
+/**
+ * @brief Writes a whole buffer to a file descriptor.
+ * 
+ * @param fd File descriptor.
+ * @param buffer Data to write.
+ * @param length Number of bytes to write.
+ * @return 1 on success, 0 on error.
+ */
+static int HMMwrite_all(int fd, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if (written <= 0)
+        {
+            return 0;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 1;
+}
+/**
+ * @brief Writes the sampled allocations to a file in pprof's legacy heap profile format.
+ * 
+ * Each line gives, for one call stack, the sampled blocks still allocated and their
+ * bytes, then all the sampled allocations made so far and their bytes; pprof scales
+ * them by the sampling interval in the heap_v2 header. The process's mappings follow
+ * so that pprof can symbolize the addresses. Nothing is allocated with malloc, so
+ * the profile is consistent with the heap at the time of the call.
+ * 
+ * @param path File to write.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int hmm_dump_profile(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    char line[64 + PROFILE_DEPTH * 20];
+    int ok = 1;
+    pthread_mutex_lock(&profile_mutex);
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < PROFILE_TABLE_SIZE; i++)
+    {
+        for (hmm_profile_bucket_t *bucket = profile_buckets[i]; bucket; bucket = bucket->next)
+        {
+            live_count += bucket->allocs - bucket->frees;
+            live_bytes += bucket->alloc_bytes - bucket->free_bytes;
+            alloc_count += bucket->allocs;
+            alloc_bytes += bucket->alloc_bytes;
+        }
+    }
+    int length = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                          live_count, live_bytes, alloc_count, alloc_bytes, profile_period);
+    ok = HMMwrite_all(fd, line, length);
+    for (size_t i = 0; ok && (i < PROFILE_TABLE_SIZE); i++)
+    {
+        for (hmm_profile_bucket_t *bucket = profile_buckets[i]; ok && bucket; bucket = bucket->next)
+        {
+            length = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @",
+                              bucket->allocs - bucket->frees, bucket->alloc_bytes - bucket->free_bytes, bucket->allocs, bucket->alloc_bytes);
+            for (size_t frame = 0; frame < bucket->depth; frame++)
+            {
+                length += snprintf(line + length, sizeof(line) - length, " %p", bucket->stack[frame]);
+            }
+            line[length++] = '\n';
+            ok = HMMwrite_all(fd, line, length);
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+    const char *maps_header = "\nMAPPED_LIBRARIES:\n";
+    ok = ok && HMMwrite_all(fd, maps_header, strlen(maps_header));
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0)
+    {
+        ssize_t count;
+        while (ok && ((count = read(maps, line, sizeof(line))) > 0))
+        {
+            ok = HMMwrite_all(fd, line, count);
+        }
+        close(maps);
+    }
+    return ((close(fd) == 0) && ok) ? 0 : -1;
+}
 /**
- * @brief Removes a free memory block from the list of free blocks in hash table.
+ * @brief Steps through the best-fit tree of an arena in order.
  * 
- * @param block Pointer to the memory block to be removed.
+ * @param arena Arena owning the tree.
+ * @param node Current node, or NULL to start.
+ * @return The node following node (the first node when node is NULL), NULL at the end.
  */
-
-static void HMMremove_free_block(mem_chunk_t *block)
+static tree_chunk_t *HMMtree_next(hmm_arena_t *arena, tree_chunk_t *node)
 {
-    if (block == NULL)
+    if ((node == NULL) || node->right)
+    {
+        node = node ? node->right : arena->tree_root;
+        while (node && node->left)
+        {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent && (node == node->parent->right))
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
+/**
+ * @brief Gives the pages of a free chunk back to the system, keeping the chunk in place.
+ * 
+ * The whole pages of the payload past its links are dropped with madvise and the
+ * partial pages at both ends are cleared, so the chunk becomes zeroed: the pages are
+ * faulted back in as zero pages when the chunk is reused. With huge pages, only
+ * whole huge pages are dropped, so none of them is split into small pages.
+ * 
+ * @param chunk Free chunk.
+ */
+static void HMMpurge_chunk(mem_chunk_t *chunk)
+{
+    size_t granule = HMMrelease_granule();
+    unsigned char *start = (unsigned char *)chunk + CHUNK_HEADER_SIZE + ZEROED_DIRTY_SIZE;
+    unsigned char *end = (unsigned char *)chunk + CHUNK_HEADER_SIZE + HMMchunk_size(chunk);
+    unsigned char *first_page = (unsigned char *)(((uintptr_t)start + granule - 1) & ~((uintptr_t)granule - 1));
+    unsigned char *last_page = (unsigned char *)((uintptr_t)end & ~((uintptr_t)granule - 1));
+    if (first_page >= last_page)
+    {
         return;
-        // Calculate the index for the block based on its size.
-    if (block->is_added == 0){
+    }
+    HMMstat_add(STAT_MADVISE_CALLS, 1);
+    if (madvise(first_page, last_page - first_page, MADV_DONTNEED) != 0)
+    {
         return;
     }
-    size_t cur_size = block->size;
-    size_t idx = (cur_size / ALIGNMENT) - 1;
-        // If the index is within bounds, traverse the free list to remove the block.
-
-    if (idx < MULTIPLES_MAX)
+    HMMstat_add(STAT_PURGED_BYTES, last_page - first_page);
+    memset(start, 0, first_page - start);
+    memset(last_page, 0, end - last_page);
+    chunk->size |= CHUNK_ZEROED;
+}
+/**
+ * @brief Returns the memory of the free tree chunks of an arena that have decayed.
+ * 
+ * A chunk that has stayed free for age ticks is trimmed if it ends its segment
+ * and is large enough (or spans the whole segment), and purged in place otherwise.
+ * Reusing a chunk, even in part, restarts its clock, so memory that keeps being
+ * reused is never returned. Empty slabs are returned by HMMslab_scavenge.
+ * 
+ * @param arena Arena to scavenge (locked by the caller).
+ * @param epoch Current scavenger tick.
+ * @param age Ticks a chunk must have stayed free: DECAY_STEPS, or 0 to return every chunk.
+ * @return 1 if memory was returned, 0 otherwise.
+ */
+static int HMMscavenge_arena(hmm_arena_t *arena, size_t epoch, size_t age)
+{
+    int released = 0;
+    tree_chunk_t *node = HMMtree_next(arena, NULL);
+    while (node)
     {
-        mem_chunk_t *current = block_freq[idx];
-        mem_chunk_t *prev = NULL;
-        while (current)
+        tree_chunk_t *next = HMMtree_next(arena, node);
+        mem_chunk_t *chunk = (mem_chunk_t *)node;
+        if (epoch - node->freed_epoch >= age)
         {
-            if (current == block)
+            hmm_segment_t *segment = HMMsegment_for_address(chunk);
+            if ((HMMnext_chunk(chunk) == segment->tail) &&
+                ((HMMchunk_size(chunk) + CHUNK_HEADER_SIZE >= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED)) || (chunk == HMMsegment_first_chunk(segment))))
             {
-                // Update flags and sizes accordingly.
-                current->is_added = 0;
-                current_free_size -= (current->size  + sizeof(mem_chunk_t));
-                if (prev)
-                {
-                    prev->next_free = current->next_free;
-                }
-                else
-                {
-                    block_freq[idx] = block_freq[idx]->next_free;
-                }
-                break;
+                HMMremove_free_block(arena, chunk);
+                HMMrelease_last_chunk(arena, chunk);
+                released = 1;
+            }
+            else if (!(chunk->size & CHUNK_ZEROED))
+            {
+                HMMpurge_chunk(chunk);
+                released |= ((chunk->size & CHUNK_ZEROED) != 0);
             }
-            prev = current;
-            current = current->next_free;
         }
+        node = next;
     }
+    released |= HMMslab_scavenge(arena, epoch, age);
+    return released;
 }
 /**
- * @brief Checks if a memory block is found in the list of free blocks in hash table.
+ * @brief Gives back the end of the free chunk closing a segment, keeping its first pad bytes.
  * 
- * @param block Pointer to the memory block to be checked.
- * @return 1 if the block is found, 0 otherwise.
+ * The kept part stays a free chunk; with pad 0, a chunk spanning the whole segment
+ * unmaps it.
+ * 
+ * @param arena Arena owning the segment (locked by the caller).
+ * @param chunk Free chunk preceding the fencepost, in the bins or the tree.
+ * @param pad Payload bytes of the chunk to keep.
+ * @return 1 if memory was returned, 0 if the chunk does not reach past pad by a release granule.
  */
-static unsigned char HMMis_block_found(mem_chunk_t *block)
+static int HMMtrim_last_chunk(hmm_arena_t *arena, mem_chunk_t *chunk, size_t pad)
 {
-    return block->is_added;
+    hmm_segment_t *segment = HMMsegment_for_address(chunk);
+    size_t granule = HMMrelease_granule();
+    if (pad >= HMMchunk_size(chunk))
+    {
+        return 0;
+    }
+    pad = (pad + ALIGNMENT - 1) & ~((size_t)ALIGNMENT - 1);
+    if ((pad != 0) && (HMMchunk_size(chunk) < pad + CHUNK_HEADER_SIZE + MIN_PAYLOAD_SIZE))
+    {
+        return 0;
+    }
+    mem_chunk_t *rest = (mem_chunk_t *)((unsigned char *)chunk + ((pad != 0) ? CHUNK_HEADER_SIZE + pad : 0));
+    size_t used = (unsigned char *)rest + CHUNK_HEADER_SIZE - (unsigned char *)segment;
+    if ((rest != HMMsegment_first_chunk(segment)) && (((used + granule - 1) & ~(granule - 1)) >= segment->size))
+    {
+        return 0;
+    }
+    HMMremove_free_block(arena, chunk);
+    if (rest == chunk)
+    {
+        HMMrelease_last_chunk(arena, chunk);
+        return 1;
+    }
+    HMMset_chunk_size(chunk, pad);
+    HMMrelease_last_chunk(arena, rest);
+    HMMset_free(chunk);
+    HMMadd_free_block(arena, chunk);
+    return 1;
 }
 /**
- * @brief Adds a free memory block to the list of free blocks in hash table.
+ * @brief Returns the free pages of a chunk to the system, for malloc_trim.
  * 
- * @param block Pointer to the memory block to be added.
+ * @param arena Arena owning the chunk (locked by the caller).
+ * @param chunk Free chunk, in the bins or the tree.
+ * @param pad Free bytes to keep at the end of a segment.
+ * @return 1 if memory was returned, 0 otherwise.
  */
-static void HMMadd_free_block(mem_chunk_t *block)
+static int HMMtrim_free_chunk(hmm_arena_t *arena, mem_chunk_t *chunk, size_t pad)
 {
-    if (block == NULL)
-        return;
-// Calculate the index for the block based on its size.
-    size_t cur_size = block->size;
-    size_t idx = (cur_size / ALIGNMENT) - 1;
-        // If the index is within bounds and the block is not already added, add it to the free list.
-
-    if (idx < MULTIPLES_MAX)
+    if (HMMnext_chunk(chunk) == HMMsegment_for_address(chunk)->tail)
     {
-        if (block->is_added == 1)
-            return;
-        current_free_size+=(block->size + sizeof(mem_chunk_t));
-        block->is_added = 1;
-        if (block_freq[idx] == NULL)
+        if (HMMtrim_last_chunk(arena, chunk, pad))
         {
-            block_freq[idx] = block;
-            block->next_free = NULL;
+            return 1;
         }
-        else
+        if (pad != 0)
         {
-            block->next_free = block_freq[idx];
-            block_freq[idx] = block;
+            // The chunk does not reach a release granule past its first pad bytes, which stay committed.
+
+            return 0;
         }
     }
+    if (chunk->size & CHUNK_ZEROED)
+    {
+        return 0;
+    }
+    HMMpurge_chunk(chunk);
+    return (chunk->size & CHUNK_ZEROED) != 0;
 }
 /**
- * @brief Retrieves a free memory block of a specified size in hash table based on size.
+ * @brief Returns every free page of an arena to the system, for malloc_trim.
  * 
- * @param size Size of the memory block to retrieve.
- * @return Pointer to the free memory block if found, NULL otherwise.
+ * Unlike the scavenger, it ignores trim_threshold and how long memory has been
+ * free: each chunk closing a segment is trimmed down to pad bytes, the whole pages
+ * of every other free chunk, in the bins as well as in the tree, are purged, and
+ * so are empty slabs. A chunk put back by the trim may be visited again, which
+ * leaves it as it is.
+ * 
+ * @param arena Arena to trim (locked by the caller).
+ * @param epoch Current scavenger tick.
+ * @param pad Free bytes to keep at the end of each segment.
+ * @return 1 if memory was returned, 0 otherwise.
  */
-static mem_chunk_t *HMMget_free_block(size_t size)
+static int HMMtrim_arena(hmm_arena_t *arena, size_t epoch, size_t pad)
 {
-    size_t idx = (size / ALIGNMENT) - 1;
-    if (idx < MULTIPLES_MAX)
+    int released = 0;
+    for (size_t fl = 0; fl < FL_COUNT; fl++)
     {
-        if (block_freq[idx])
+        for (size_t sl = 0; sl < SL_COUNT; sl++)
         {
-            mem_chunk_t *ret = block_freq[idx];
-            current_free_size-=(ret->size + sizeof(mem_chunk_t));
-            ret->is_added = 0;
-            block_freq[idx] = block_freq[idx]->next_free;
-            return ret;
+            mem_chunk_t *chunk = arena->free_bins[fl][sl];
+            while (chunk)
+            {
+                mem_chunk_t *next = chunk->next_free;
+                released |= HMMtrim_free_chunk(arena, chunk, pad);
+                chunk = next;
+            }
         }
     }
-    return NULL;
+    tree_chunk_t *node = HMMtree_next(arena, NULL);
+    while (node)
+    {
+        tree_chunk_t *next = HMMtree_next(arena, node);
+        released |= HMMtrim_free_chunk(arena, (mem_chunk_t *)node, pad);
+        node = next;
+    }
+    released |= HMMslab_scavenge(arena, epoch, 0);
+    return released;
 }
 /**
- * @brief Coalesces adjacent free memory blocks starting from a specified block.
+ * @brief Body of the scavenger thread: scavenges every arena once per tick until stopped.
  * 
- * @param start Pointer to the starting memory block for coalescing.
+ * @param arg Unused.
+ * @return NULL.
  */
-static void HMMcoalesce(mem_chunk_t *start)
+static void *HMMscavenger_main(void *arg)
 {
-    mem_chunk_t *current = start;
-    if (current != NULL)
+    (void)arg;
+    pthread_mutex_lock(&scavenger_mutex);
+    while (!scavenger_stopping)
     {
-        mem_chunk_t *last_collecting = NULL;
-        size_t total_size = 0;
-        while (current)
+        size_t tick_ms = decay_ms / DECAY_STEPS;
+        if (tick_ms == 0)
         {
-            if (current && (current->is_free == 1))
-            {
-                if (last_collecting == NULL)
-                {
-                    last_collecting = current;
-                }
-                else
-                {
-                    total_size += current->size + sizeof(mem_chunk_t);
-                }
-            }
-            else
-            {
-                break;
-            }
-            HMMremove_free_block(current);
-            current = current->next;
+            tick_ms = 1;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += tick_ms / 1000;
+        deadline.tv_nsec += (tick_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
-        if (total_size > 0)
+        if ((pthread_cond_timedwait(&scavenger_cond, &scavenger_mutex, &deadline) == 0) || scavenger_stopping)
         {
-            last_collecting->size += total_size;
-            last_collecting->next = current;
-            if (current)
-                current->prev = last_collecting;
-            if (current == NULL)
+            // Woken up early: the decay time changed or the thread is being stopped.
+
+            continue;
+        }
+        pthread_mutex_unlock(&scavenger_mutex);
+        size_t epoch = __atomic_add_fetch(&scavenger_epoch, 1, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++)
+        {
+            hmm_arena_t *arena = arenas[i];
+            if (HMMlock_arena(arena) != 0)
             {
-                tail = last_collecting;
-                tail->next = NULL;
+                continue;
             }
+            HMMremote_drain(arena);
+            HMMscavenge_arena(arena, epoch, DECAY_STEPS);
+            pthread_mutex_unlock(&arena->alloc_mutex);
         }
+        pthread_mutex_lock(&scavenger_mutex);
     }
+    pthread_mutex_unlock(&scavenger_mutex);
+    return NULL;
 }
 /**
- * @brief Retrieves/Creates a free memory chunk of a specified size.
+ * @brief Initializes scavenger_cond to time its waits on the monotonic clock.
+ */
+static void HMMscavenger_cond_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scavenger_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    scavenger_cond_ready = 1;
+}
+/**
+ * @brief Starts the scavenger thread, or changes its decay time if it already runs.
  * 
- * @param size Size of the memory chunk to retrieve.
- * @return Pointer to the free memory chunk if found, NULL otherwise.
+ * While the scavenger runs, free never trims: memory goes back to the system from
+ * the background thread once it has stayed free for the decay time.
+ * 
+ * @param decay Decay time in milliseconds (non-zero).
+ * @return 0 on success, -1 if decay is 0 or the thread could not be created.
  */
-static mem_chunk_t *HMMget_free_chunk(size_t size)
-{    // Try to get a free block from the free list.
-
-    mem_chunk_t *get_free = HMMget_free_block(size);
-    if (get_free)
+int hmm_scavenger_start(size_t decay)
+{
+    if (decay == 0)
     {
-        return get_free;
+        return -1;
     }
-        // If no suitable free block found, allocate new memory.
-
-    mem_chunk_t *current = tail;
-    while (current)
+    int ret = 0;
+    pthread_mutex_lock(&scavenger_mutex);
+    if (!scavenger_cond_ready)
     {
-        if ((current->is_free == 1) && (current->size >= size))
-        {
-                        // Remove the block from the free list.
-
-            HMMremove_free_block(current);
-                        // Split the block if it's larger than required.
-
-            if ((current->size > (sizeof(mem_chunk_t) + size)))
-            {
-                mem_chunk_t *current_next = current->next;
-                mem_chunk_t *splitted = (mem_chunk_t *)((size_t)current + sizeof(mem_chunk_t) + size);
-                // Initialize the new block.
-
-                splitted->prev = current;
-                splitted->next = current_next;
-                splitted->is_free = 1;
-                if (current_next)
-                    current_next->prev = splitted;
-                current->next = splitted;
-                if (current == tail)
-                {
-                    tail = splitted;
-                    tail->next = NULL;
-                }
-                splitted->size = current->size - size - sizeof(mem_chunk_t);
-                HMMadd_free_block(splitted);
-                current->size = size;
-            }
-            return current;
-        }
-        else if (current->is_free == 1)
-        {
-            HMMadd_free_block(current);
-        }
-        current = current->prev;
+        HMMscavenger_cond_init();
     }
-        // If no free block is large enough, allocate new memory from the system.
-
-    size_t allocation_size = ALLOCATED_BYTES;
-    size_t num_allocated_bytes = ((size + sizeof(mem_chunk_t) + allocation_size) / allocation_size) * allocation_size;
-    void *new_free_space = sbrk(num_allocated_bytes);
-    if (new_free_space == (void *)-1)
+    if (decay_ms != 0)
     {
-        write(STDOUT_FILENO,"FAILED\n",8);
-        return NULL;
+        __atomic_store_n(&decay_ms, decay, __ATOMIC_RELAXED);
+        pthread_cond_signal(&scavenger_cond);
     }
-        // Remove the tail block from the free list and update it.
-
-    HMMremove_free_block(tail);
-    if (tail && (tail->is_free == 1))
+    else
     {
-        tail->size += num_allocated_bytes;
-        tail->next = NULL;
-        return HMMget_free_chunk(size);
-    }
-        // Initialize a new memory chunk and add it to the list.
+        // The thread must not take signals meant for the application.
 
-    mem_chunk_t *new_chunk = (mem_chunk_t *)new_free_space;
-    new_chunk->is_free = 1;
-    new_chunk->size = num_allocated_bytes - sizeof(mem_chunk_t);
-    new_chunk->prev = tail;
-    new_chunk->next = NULL;
-    if (tail)
-        tail->next = new_chunk;
-    tail = new_chunk;
-    tail->next = NULL;
-    if (head == NULL)
-        head = tail;
-    HMMadd_free_block(tail);
-    return HMMget_free_chunk(size);
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        scavenger_stopping = 0;
+        __atomic_store_n(&decay_ms, decay, __ATOMIC_RELAXED);
+        if (pthread_create(&scavenger_thread, NULL, HMMscavenger_main, NULL) != 0)
+        {
+            __atomic_store_n(&decay_ms, 0, __ATOMIC_RELAXED);
+            ret = -1;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    pthread_mutex_unlock(&scavenger_mutex);
+    return ret;
 }
 /**
- * @brief Frees the memory associated with a given pointer.
- * 
- * @param ptr Pointer to the memory to be freed.
+ * @brief Stops the scavenger thread, so that free trims inline again.
  */
-static void HMMfree(void *ptr)
+void hmm_scavenger_stop(void)
 {
-    if (ptr == NULL)
-    {
-        return;
-    }
-    // Get the memory chunk from the given pointer.
-
-    mem_chunk_t *alloacted_member = (mem_chunk_t *)((unsigned char *)ptr - sizeof(mem_chunk_t)); 
-        // Check if the memory is already free, if not, free it.
-
-    if (alloacted_member->is_free == 0)
-    {
-        alloacted_member->is_free = 1;
-    }
-    else
+    pthread_mutex_lock(&scavenger_mutex);
+    if (decay_ms == 0)
     {
+        pthread_mutex_unlock(&scavenger_mutex);
         return;
     }
-    // Coalesce adjacent free blocks.
-
-    if (alloacted_member->prev && alloacted_member->prev->is_free == 1)
-    {
-        HMMcoalesce(alloacted_member->prev);
-        HMMadd_free_block(alloacted_member->prev);
-    }
-    else if (alloacted_member->next && alloacted_member->next->is_free == 1)
+    scavenger_stopping = 1;
+    pthread_cond_signal(&scavenger_cond);
+    pthread_mutex_unlock(&scavenger_mutex);
+    pthread_join(scavenger_thread, NULL);
+    pthread_mutex_lock(&scavenger_mutex);
+    __atomic_store_n(&decay_ms, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&scavenger_mutex);
+}
+/**
+ * @brief Returns free memory to the system right away, whatever the decay time.
+ * 
+ * The calling thread's cache is flushed first. Then every free chunk is handed back:
+ * trimmed down to pad bytes when it ends its segment, whatever trim_threshold is, its
+ * whole pages dropped with madvise otherwise. Empty slabs are dropped as well.
+ * 
+ * @param pad Free bytes to keep at the end of each segment.
+ * @return 1 if memory was returned, 0 otherwise.
+ */
+int malloc_trim(size_t pad)
+{
+    int released = 0;
+    size_t epoch = __atomic_load_n(&scavenger_epoch, __ATOMIC_RELAXED);
+    if (tcache.state == TCACHE_ACTIVE)
     {
-        HMMcoalesce(alloacted_member);
-        HMMadd_free_block(alloacted_member);
+        for (size_t idx = 0; idx < TCACHE_BINS; idx++)
+        {
+            HMMtcache_flush(idx, 0);
+        }
     }
-    else
+    for (size_t i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++)
     {
-        HMMadd_free_block(alloacted_member);
+        hmm_arena_t *arena = arenas[i];
+        if (HMMlock_arena(arena) != 0)
+        {
+            continue;
+        }
+        HMMremote_drain(arena);
+        released |= HMMtrim_arena(arena, epoch, pad);
+        pthread_mutex_unlock(&arena->alloc_mutex);
     }
-        // Free excess memory if available.
+    return released;
+}
+/**
+ * @brief Sets an allocator parameter, as glibc's mallopt does.
+ * 
+ * M_MMAP_THRESHOLD sets mmap_threshold, M_TRIM_THRESHOLD sets trim_threshold and
+ * M_ARENA_MAX caps the number of arenas; M_HMM_GROW_BYTES and M_HMM_TCACHE_MAX (HMM.h)
+ * set grow_bytes and tcache_count. Values set here override the HMM_* environment
+ * variables. The other glibc parameters are accepted and have no effect.
+ * 
+ * @param param Parameter (an M_ constant of malloc.h or HMM.h).
+ * @param value New value.
+ * @return 1 on success, 0 for an unknown parameter or an invalid value.
+ */
+int mallopt(int param, int value)
+{
+        // Load the environment first, so it does not override this setting later.
 
-    mem_chunk_t *current = tail;
-    size_t total_size = 0;
-    if (current_free_size >= ALLOCATED_BYTES)
+    HMMtunables_init();
+    switch (param)
     {
-
-        while (current)
+    case M_MMAP_THRESHOLD:
+        if (value < 0)
         {
-            if (current->is_free == 1)
-            {
-                total_size += current->size + sizeof(mem_chunk_t);
-                HMMremove_free_block(current);
-            }
-            else
-            {
-                break;
-            }
-            current = current->prev;
+            return 0;
         }
-        if (total_size >= ALLOCATED_BYTES)
+        __atomic_store_n(&mmap_threshold, (size_t)value, __ATOMIC_RELAXED);
+        return 1;
+    case M_ARENA_MAX:
+        if (value <= 0)
         {
-            if (current == NULL)
-            {
-                head = tail = NULL;
-            }
-            else
-            {
-                tail = current;
-                tail->next = NULL;
-            }
-            void *new_break = sbrk(-total_size);
-            if (new_break == (void *)-1)
-            {
-                return;
-            }
+            return 0;
+        }
+        pthread_mutex_lock(&arenas_mutex);
+        arena_max = ((size_t)value < ARENA_LIMIT) ? (size_t)value : ARENA_LIMIT;
+        pthread_mutex_unlock(&arenas_mutex);
+        return 1;
+    case M_TRIM_THRESHOLD:
+        if (value < 0)
+        {
+            return 0;
+        }
+        __atomic_store_n(&trim_threshold, (size_t)value, __ATOMIC_RELAXED);
+        return 1;
+    case M_HMM_GROW_BYTES:
+        if (value <= 0)
+        {
+            return 0;
+        }
+        __atomic_store_n(&grow_bytes, HMMgrow_step((size_t)value), __ATOMIC_RELAXED);
+        return 1;
+    case M_HMM_TCACHE_MAX:
+        if ((value < 0) || (value > TCACHE_COUNT_LIMIT))
+        {
+            return 0;
         }
+        __atomic_store_n(&tcache_count, (size_t)value, __ATOMIC_RELAXED);
+        return 1;
+    case M_TOP_PAD:
+    case M_MMAP_MAX:
+    case M_CHECK_ACTION:
+    case M_PERTURB:
+    case M_ARENA_TEST:
+        return 1;
+    default:
+        return 0;
     }
 }
 /**
- * @brief Allocates memory of a specified size.
+ * @brief Returns the allocator's statistics as glibc's mallinfo2 does.
  * 
- * @param size Size of the memory to allocate.
- * @return Pointer to the allocated memory if successful, NULL otherwise.
+ * @return The statistics.
  */
-static void *HMMmalloc(size_t size)
+struct mallinfo2 mallinfo2(void)
 {
-    if (size == 0)
-    {
-        size = ALIGNMENT;
-    }
-    size = (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
-    mem_chunk_t *allocated_area_data = HMMget_free_chunk(size);
-    if (allocated_area_data == NULL)
-    {
-        return NULL;
-    }
-    allocated_area_data->is_free = 0;
-    return (void *)((allocated_area_data + 1));
+    struct hmm_mallinfo stats = hmm_mallinfo();
+    struct mallinfo2 info;
+    info.arena = stats.arena;
+    info.ordblks = stats.ordblks;
+    info.smblks = stats.smblks;
+    info.hblks = stats.hblks;
+    info.hblkhd = stats.hblkhd;
+    info.usmblks = stats.usmblks;
+    info.fsmblks = stats.fsmblks;
+    info.uordblks = stats.uordblks;
+    info.fordblks = stats.fordblks;
+    info.keepcost = stats.keepcost;
+    return info;
 }
 /**
- * @brief Allocates memory for an array of elements, each with a specified size.
+ * @brief Returns the allocator's statistics as glibc's mallinfo does, truncated to int.
  * 
- * @param nmemb Number of elements.
- * @param size Size of each element.
- * @return Pointer to the allocated memory if successful, NULL otherwise.
+ * @return The statistics.
  */
-static void *HMMcalloc(size_t nmemb, size_t size)
+struct mallinfo mallinfo(void)
 {
-    if (size != 0 && (nmemb > (ULONG_MAX / size)))
-    {
-        return NULL;
-    }
-    size = ((size * nmemb) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
-    if (size == 0)
-        size = ALIGNMENT;
-    void *allocated_area = HMMmalloc(size);
-    if (allocated_area == NULL)
+    struct mallinfo2 stats = mallinfo2();
+    struct mallinfo info;
+    info.arena = (int)stats.arena;
+    info.ordblks = (int)stats.ordblks;
+    info.smblks = (int)stats.smblks;
+    info.hblks = (int)stats.hblks;
+    info.hblkhd = (int)stats.hblkhd;
+    info.usmblks = (int)stats.usmblks;
+    info.fsmblks = (int)stats.fsmblks;
+    info.uordblks = (int)stats.uordblks;
+    info.fordblks = (int)stats.fordblks;
+    info.keepcost = (int)stats.keepcost;
+    return info;
+}
+/**
+ * @brief Prints the bytes mapped and in use per arena and in total to stderr, as glibc's malloc_stats does.
+ */
+void malloc_stats(void)
+{
+    hmm_stats_t total;
+    hmm_stats(&total);
+    for (size_t i = 0; i < total.arenas; i++)
     {
-        return NULL;
+        hmm_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        hmm_arena_t *arena = arenas[i];
+        pthread_mutex_lock(&arena->alloc_mutex);
+        HMMarena_stats(arena, &stats);
+        pthread_mutex_unlock(&arena->alloc_mutex);
+        fprintf(stderr, "Arena %zu:\nsystem bytes     = %10zu\nin use bytes     = %10zu\n", i, stats.bytes_mapped, stats.bytes_in_use);
     }
-    memset(allocated_area, 0, ((mem_chunk_t *)allocated_area - 1)->size);
-    return allocated_area;
+    fprintf(stderr, "Total (incl. mmap):\nsystem bytes     = %10zu\nin use bytes     = %10zu\n", total.bytes_mapped, total.bytes_in_use + total.mmap_bytes);
+    fprintf(stderr, "mmap regions     = %10zu\nmmap bytes       = %10zu\n", total.mmap_chunks, total.mmap_bytes);
 }
 /**
- * @brief Changes the size of the memory block pointed to by a given pointer.
+ * @brief Writes the allocator's state as XML, in the shape of glibc's malloc_info.
  * 
- * @param ptr Pointer to the previously allocated memory block.
- * @param size New size for the memory block.
- * @return Pointer to the reallocated memory block if successful, NULL otherwise.
+ * @param options Must be 0.
+ * @param fp Stream to write to.
+ * @return 0 on success, -1 with errno set to EINVAL if options is not 0.
  */
-static void *HMMrealloc(void *ptr, size_t size)
+int malloc_info(int options, FILE *fp)
 {
-    size = ((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
-    if (ptr == NULL)
-    {
-        return HMMmalloc(size);
-    }
-    if (size == 0)
-    {
-        HMMfree(ptr);
-        return HMMmalloc(ALIGNMENT);
-    }
-    if (size == ((mem_chunk_t *)ptr - 1)->size)
-    {
-        return ptr;
-    }
-    void *allocated_chunk = HMMmalloc(size);
-    if (allocated_chunk == NULL)
-    {
-        return NULL;
-    }
-    size_t allocation_size;
-    if (((mem_chunk_t *)ptr - 1)->size < ((mem_chunk_t *)allocated_chunk - 1)->size)
+    if (options != 0)
     {
-        allocation_size = ((mem_chunk_t *)ptr - 1)->size;
+        errno = EINVAL;
+        return -1;
     }
-    else
+    hmm_stats_t total;
+    hmm_stats(&total);
+    fprintf(fp, "<malloc version=\"1\">\n");
+    for (size_t i = 0; i < total.arenas; i++)
     {
-        allocation_size = ((mem_chunk_t *)allocated_chunk - 1)->size;
+        hmm_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        hmm_arena_t *arena = arenas[i];
+        pthread_mutex_lock(&arena->alloc_mutex);
+        HMMarena_stats(arena, &stats);
+        pthread_mutex_unlock(&arena->alloc_mutex);
+        size_t free_count = 0;
+        fprintf(fp, "<heap nr=\"%zu\">\n<sizes>\n", i);
+        for (size_t c = 0; c < HMM_SIZE_CLASSES; c++)
+        {
+            if (stats.chunks_free[c] != 0)
+            {
+                fprintf(fp, "  <size from=\"%zu\" to=\"%zu\" count=\"%zu\"/>\n", (size_t)1 << c, ((size_t)2 << c) - 1, stats.chunks_free[c]);
+                free_count += stats.chunks_free[c];
+            }
+        }
+        fprintf(fp, "</sizes>\n<total type=\"free\" count=\"%zu\" size=\"%zu\"/>\n<system type=\"current\" size=\"%zu\"/>\n</heap>\n", free_count, stats.bytes_free, stats.bytes_mapped);
     }
-    memcpy(allocated_chunk, ptr, allocation_size);
-    HMMfree(ptr);
-    return (void *)allocated_chunk;
+    fprintf(fp, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n<system type=\"current\" size=\"%zu\"/>\n</malloc>\n", total.mmap_chunks, total.mmap_bytes, total.bytes_mapped);
+    return 0;
 }
 /**
- * @brief Wrapper function for thread-safe memory allocation.
+ * @brief Takes every allocator lock before fork, so the child starts with consistent state.
  * 
- * @param size Size of the memory to allocate.
- * @return Pointer to the allocated memory if successful, NULL otherwise.
+ * Locks are taken in the order the allocator nests them: the scavenger and profiler
+ * locks, arena creation, each arena, then the statistics list.
  */
-void *malloc(size_t size)
+static void HMMfork_prepare(void)
 {
-    if (pthread_mutex_lock(&alloc_mutex)!=0){
-        return NULL;
+    pthread_mutex_lock(&scavenger_mutex);
+    pthread_mutex_lock(&profile_mutex);
+    pthread_mutex_lock(&arenas_mutex);
+    for (size_t i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_lock(&arenas[i]->alloc_mutex);
     }
-    void *ret_ptr = HMMmalloc(size);
-    pthread_mutex_unlock(&alloc_mutex);
-    return ret_ptr;
+    pthread_mutex_lock(&stats_mutex);
 }
 /**
- * @brief Wrapper function for thread-safe memory deallocation.
- * 
- * @param ptr Pointer to the memory to be freed.
+ * @brief Releases the locks taken by HMMfork_prepare in the parent.
  */
-void free(void *ptr)
+static void HMMfork_parent(void)
 {
-    if (pthread_mutex_lock(&alloc_mutex)!=0){
-        return;
+    pthread_mutex_unlock(&stats_mutex);
+    for (size_t i = arena_count; i-- > 0;)
+    {
+        pthread_mutex_unlock(&arenas[i]->alloc_mutex);
     }
-    HMMfree(ptr);
-    pthread_mutex_unlock(&alloc_mutex);
+    pthread_mutex_unlock(&arenas_mutex);
+    pthread_mutex_unlock(&profile_mutex);
+    pthread_mutex_unlock(&scavenger_mutex);
 }
 /**
- * @brief Wrapper function for thread-safe calloc.
+ * @brief Resets the locks taken by HMMfork_prepare in the child.
  * 
- * @param nmemb Number of elements.
- * @param size Size of each element.
- * @return Pointer to the allocated memory if successful, NULL otherwise.
+ * The child only has the forking thread, so the scavenger thread is gone: free
+ * trims inline again until hmm_scavenger_start is called anew.
  */
-void *calloc(size_t nmemb, size_t size)
+static void HMMfork_child(void)
 {
-    if (pthread_mutex_lock(&alloc_mutex)!=0){
-        return NULL;
+    pthread_mutex_init(&stats_mutex, NULL);
+    for (size_t i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_init(&arenas[i]->alloc_mutex, NULL);
     }
-    void *ret_ptr = HMMcalloc(nmemb, size);
-    pthread_mutex_unlock(&alloc_mutex);
-    return ret_ptr;
+    pthread_mutex_init(&arenas_mutex, NULL);
+    pthread_mutex_init(&profile_mutex, NULL);
+    decay_ms = 0;
+    scavenger_stopping = 0;
+    if (scavenger_cond_ready)
+    {
+        HMMscavenger_cond_init();
+    }
+    pthread_mutex_init(&scavenger_mutex, NULL);
 }
 /**
- * @brief Wrapper function for thread-safe realloc.
+ * @brief Registers the fork handlers when the library is loaded.
  * 
- * @param ptr Pointer to the previously allocated memory block.
- * @param size New size for the memory block.
- * @return Pointer to the reallocated memory block if successful, NULL otherwise.
+ * pthread_atfork may allocate, so it is called here rather than from inside the
+ * allocator, where an arena lock could be held.
  */
-void *realloc(void *ptr, size_t size)
+static __attribute__((constructor)) void HMMregister_fork_handlers(void)
 {
-    if (pthread_mutex_lock(&alloc_mutex)!=0){
-        return NULL;
-    }
-    void *ret_ptr = HMMrealloc(ptr, size);
-    pthread_mutex_unlock(&alloc_mutex);
-    return ret_ptr;
+    pthread_atfork(HMMfork_prepare, HMMfork_parent, HMMfork_child);
 }
 /**
- * @brief Traverses the memory chunk linked list and prints information about each chunk.
+ * @brief Turns transparent huge page backing of the heap on or off.
+ * 
+ * Every segment already mapped is advised as well, so the whole heap follows the setting.
+ * 
+ * @param enable Non-zero to back the heap with huge pages, 0 to stop.
  */
-void HMMtraverse(void)
+void hmm_set_huge_pages(int enable)
 {
-    mem_chunk_t *cur = head;
-    size_t cnt = 1;
-    while (cur)
+    __atomic_store_n(&huge_pages, enable != 0, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++)
     {
-        printf("Node number: %d, Address: %10p, free: %lu, size: %lu\r\n", cnt, cur, cur->is_free, cur->size);
-        cnt++;
-        cur = cur->next;
+        hmm_arena_t *arena = arenas[i];
+        if (HMMlock_arena(arena) != 0)
+        {
+            continue;
+        }
+        hmm_segment_t *lists[2] = {arena->segments, arena->slab_segments};
+        for (size_t list = 0; list < 2; list++)
+        {
+            for (hmm_segment_t *segment = lists[list]; segment; segment = segment->next)
+            {
+                madvise(segment, segment->size, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+                HMMstat_add(STAT_MADVISE_CALLS, 1);
+            }
+        }
+        pthread_mutex_unlock(&arena->alloc_mutex);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,238 @@
+/**
+ * @file HMM.h
+ * @brief Public interface of the heap memory allocator beyond the standard malloc family.
+ */
+
+#ifndef HMM_H
+#define HMM_H
+
+#include <stddef.h>
+
+/**< Number of size classes in hmm_stats_t: class i counts blocks of [2^i, 2^(i+1)) usable bytes. */
+#define HMM_SIZE_CLASSES 64
+
+/**< mallopt parameter: step by which segments grow, rounded up to a power of two from 2 MB to 64 MB (HMM_GROW_BYTES, 8 MB by default). */
+#define M_HMM_GROW_BYTES (-101)
+
+/**< mallopt parameter: blocks each per-thread cache bin holds, 0 to bypass the caches (HMM_TCACHE_MAX, 32 by default). */
+#define M_HMM_TCACHE_MAX (-102)
+
+/**
+ * @struct hmm_stats_t
+ * @brief Snapshot of the allocator's state and activity, filled by hmm_stats.
+ *
+ * Byte and block counts describe the arenas at the time of the call; blocks held in
+ * per-thread caches count as in use. Call and event counts cover the whole process
+ * since it started, including threads that have exited.
+ */
+
+typedef struct hmm_stats
+{
+    /**< Number of arenas created so far. */
+    size_t arenas;
+    /**< Bytes mapped read/write for arena segments and large-block mappings. */
+    size_t bytes_mapped;
+    /**< Usable bytes of the arena blocks handed out. */
+    size_t bytes_in_use;
+    /**< Usable bytes of the free arena blocks, in chunks and in slabs. */
+    size_t bytes_free;
+    /**< Bytes malloc_trim(0) would give back to the system: the end of each segment past its last block in use, the whole pages of the other free chunks not purged yet, and empty slabs. */
+    size_t bytes_releasable;
+    /**< Part of bytes_free held by free slab objects. */
+    size_t slab_bytes_free;
+    /**< Number of free slab objects, counted in chunks_free as well. */
+    size_t slab_objects_free;
+    /**< Number of blocks with their own mapping (at least mmap_threshold bytes). */
+    size_t mmap_chunks;
+    /**< Bytes mapped for those blocks, counted in bytes_mapped as well. */
+    size_t mmap_bytes;
+    /**< Arena chunks and slab objects handed out, per size class. */
+    size_t chunks_in_use[HMM_SIZE_CLASSES];
+    /**< Free arena chunks and slab objects, per size class. */
+    size_t chunks_free[HMM_SIZE_CLASSES];
+    /**< Calls to malloc. */
+    size_t malloc_calls;
+    /**< Calls to free with a non-NULL pointer. */
+    size_t free_calls;
+    /**< Calls to calloc. */
+    size_t calloc_calls;
+    /**< Calls to realloc. */
+    size_t realloc_calls;
+    /**< Allocations served from a per-thread cache without taking a lock. */
+    size_t tcache_hits;
+    /**< mmap calls (the heap is built from mmap'd segments; sbrk is never called). */
+    size_t mmap_calls;
+    /**< munmap calls. */
+    size_t munmap_calls;
+    /**< mprotect calls, which commit reserved segment memory. */
+    size_t mprotect_calls;
+    /**< mremap calls, which resize large-block mappings. */
+    size_t mremap_calls;
+    /**< Times the free memory at the end of a segment was given back to the system. */
+    size_t trim_events;
+    /**< Bytes given back by those trims. */
+    size_t trimmed_bytes;
+    /**< madvise calls, which give back the pages of free chunks that stay mapped. */
+    size_t madvise_calls;
+    /**< Bytes given back that way by the scavenger. */
+    size_t purged_bytes;
+    /**< Arena lock acquisitions. */
+    size_t lock_acquisitions;
+    /**< Arena lock acquisitions that found the lock held by another thread. */
+    size_t lock_contentions;
+} hmm_stats_t;
+
+/**
+ * @struct hmm_mallinfo
+ * @brief The allocator's state in the layout of glibc's struct mallinfo2.
+ */
+
+struct hmm_mallinfo
+{
+    /**< Bytes mapped for arena segments. */
+    size_t arena;
+    /**< Number of free chunks. */
+    size_t ordblks;
+    /**< Number of free slab objects. */
+    size_t smblks;
+    /**< Number of blocks with their own mapping. */
+    size_t hblks;
+    /**< Bytes mapped for those blocks. */
+    size_t hblkhd;
+    /**< Unused, always 0. */
+    size_t usmblks;
+    /**< Bytes of free slab objects. */
+    size_t fsmblks;
+    /**< Bytes of the arena blocks handed out. */
+    size_t uordblks;
+    /**< Bytes of the free arena blocks. */
+    size_t fordblks;
+    /**< Bytes of the free chunks ending a segment, which trimming gives back to the system. */
+    size_t keepcost;
+};
+
+/**
+ * @brief Fills a snapshot of the allocator's statistics.
+ *
+ * Each arena is walked under its lock and the per-thread counters are summed, so
+ * the cost grows with the heap size; it is meant for monitoring, not hot paths.
+ * Counters are only written by their own thread, so counting costs no atomic
+ * instruction or shared cache line; the totals of exited threads are kept.
+ *
+ * @param stats Structure to fill.
+ */
+void hmm_stats(hmm_stats_t *stats);
+
+/**
+ * @brief Returns the allocator's statistics in the layout of glibc's mallinfo2.
+ *
+ * @return The statistics.
+ */
+struct hmm_mallinfo hmm_mallinfo(void);
+
+/**
+ * @brief Turns allocation sampling on or off.
+ *
+ * While sampling is on, each thread records the call stack of one allocation every
+ * @p bytes allocated on average (the intervals are exponentially distributed, so
+ * every byte has the same chance of being sampled), and tracks the sampled block
+ * until it is freed. While it is off, malloc and free pay a single branch.
+ *
+ * @param bytes Mean number of bytes between two samples (512 KB is a common choice), 0 to stop sampling.
+ */
+void hmm_set_sample_interval(size_t bytes);
+
+/**
+ * @brief Writes the sampled allocations to a file in pprof's heap profile format.
+ *
+ * The profile holds, per call stack, both the sampled blocks still allocated and
+ * every sampled allocation so far: `pprof -sample_index=inuse_space` and
+ * `-sample_index=alloc_space` show the live and cumulative views of the same file.
+ *
+ * @param path File to write.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int hmm_dump_profile(const char *path);
+
+/**
+ * @brief Starts the scavenger thread, or changes its decay time if it already runs.
+ *
+ * Without the scavenger, free gives the end of a segment back to the system as soon
+ * as the trim threshold (M_TRIM_THRESHOLD, 8 MB by default) of it is free. With it,
+ * free never makes a system call: a background thread returns free blocks of 64 KB
+ * and more, and empty slabs, once they have stayed free for the decay time, unmapping
+ * them at the end of a segment and dropping their pages with madvise elsewhere.
+ * Memory that keeps being reused within the decay time stays mapped.
+ *
+ * @param decay_ms Decay time in milliseconds (non-zero).
+ * @return 0 on success, -1 if decay_ms is 0 or the thread could not be created.
+ */
+int hmm_scavenger_start(size_t decay_ms);
+
+/**
+ * @brief Stops the scavenger thread, so that free trims inline again.
+ */
+void hmm_scavenger_stop(void);
+
+/**
+ * @brief Frees a block whose size the caller knows (C23).
+ *
+ * The size lets blocks of up to 1024 bytes go straight to their per-thread cache
+ * bin without their segment, slab or chunk header being read; a full bin still
+ * reads them when it flushes. Declared here for C libraries that predate C23.
+ *
+ * @param ptr Pointer returned by malloc, calloc or realloc, or NULL.
+ * @param size Size requested for the block.
+ */
+void free_sized(void *ptr, size_t size);
+
+/**
+ * @brief Frees a block returned by aligned_alloc whose size the caller knows (C23).
+ *
+ * @param ptr Pointer returned by aligned_alloc, or NULL.
+ * @param alignment Alignment requested for the block.
+ * @param size Size requested for the block.
+ */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+/**
+ * @brief Turns transparent huge page backing of the heap on or off.
+ *
+ * When on, heap and slab segments (aligned on 2 MB boundaries) are advised with
+ * MADV_HUGEPAGE, and trimming and the scavenger only give back whole 2 MB pages, so
+ * no huge page is split; memory is then returned in coarser steps. Large-block
+ * mappings stay on small pages, as each would pay for clearing whole huge pages.
+ * The effect on dTLB misses has not been measured: bench_alloc --compare reports
+ * them where perf events are permitted.
+ *
+ * @param enable Non-zero to back the heap with huge pages, 0 to stop.
+ */
+void hmm_set_huge_pages(int enable);
+
+/**
+ * @brief Allocates n blocks of the same size under a single lock acquisition.
+ *
+ * Blocks larger than the slab sizes are carved from one free chunk, split once
+ * for the whole batch, so they sit next to each other in memory.
+ *
+ * @param size Size of each block.
+ * @param n Number of blocks.
+ * @param out Array of at least n entries receiving the blocks.
+ * @return Number of blocks allocated (stored in the first entries of out), less than n if memory ran out.
+ */
+size_t hmm_malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief Frees n blocks, locking each arena once and coalescing neighbouring blocks once.
+ *
+ * @param ptrs Blocks to free; NULL entries are skipped. The array is sorted by address in place.
+ * @param n Number of entries.
+ */
+void hmm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief Traverses the memory chunks of every arena and prints information about each chunk.
+ */
+void HMMtraverse(void);
+
+#endif
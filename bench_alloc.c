@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/*
+ * Allocator benchmark: replays one deterministic workload of malloc, calloc,
+ * realloc and free calls and times every call on its own, so process startup,
+ * printf and the random number generator stay out of the numbers.
+ *
+ *   ./bench_alloc                     run with the allocator in use (glibc, or LD_PRELOAD)
+ *   ./bench_alloc --json              same, printing only the JSON line
+ *   ./bench_alloc --thp               with libhmm preloaded: back its heap with huge pages first
+ *   ./bench_alloc --compare LIB.so    run with glibc, with LIB.so preloaded, and with LIB.so on huge pages
+ *
+ * dTLB load misses during the workload are counted with perf_event_open (user
+ * space only); they are reported as -1 where perf events are not available.
+ */
+
+#define NUM_OPERATIONS 1000000
+
+#define NUM_SLOTS 8192
+
+#define SEED 0x9e3779b97f4a7c15ull
+
+enum { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_FREE, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = {"malloc", "calloc", "realloc", "free"};
+
+typedef struct
+{
+    unsigned char op;
+    unsigned int slot;
+    size_t size;
+} operation_t;
+
+typedef struct
+{
+    size_t count;
+    double ns_per_op;
+    double p50;
+    double p99;
+    double p999;
+} op_stats_t;
+
+typedef struct
+{
+    char name[32];
+    op_stats_t ops[OP_COUNT];
+    long peak_rss_kb;
+    long minor_faults;
+    long major_faults;
+    long dtlb_misses;
+} bench_result_t;
+
+static uint64_t rng_state = SEED;
+
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Mostly small blocks, some medium ones and a few that reach the mmap path.
+static size_t random_size(void)
+{
+    uint64_t r = next_random();
+    switch (r % 100)
+    {
+    case 0:
+        return 256 * 1024 + (r >> 8) % (2 * 1024 * 1024);
+    case 1 ... 9:
+        return 1024 + (r >> 8) % (31 * 1024);
+    case 10 ... 29:
+        return 256 + (r >> 8) % 768;
+    default:
+        return 1 + (r >> 8) % 256;
+    }
+}
+
+// Harness buffers are mapped directly so they never go through the allocator under test.
+static void *map_buffer(size_t size)
+{
+    void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    return buffer;
+}
+
+// Counter of this process's dTLB load misses in user space, disabled; -1 if unavailable.
+static int open_dtlb_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(uint32_t *sorted, size_t count, double fraction)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static void run_workload(bench_result_t *result)
+{
+    operation_t *ops = map_buffer(NUM_OPERATIONS * sizeof(operation_t));
+    uint32_t *latencies[OP_COUNT];
+    size_t counts[OP_COUNT] = {0};
+    uint64_t totals[OP_COUNT] = {0};
+    void **slots = map_buffer(NUM_SLOTS * sizeof(void *));
+
+    // Generate the whole operation sequence up front.
+    unsigned char *live = map_buffer(NUM_SLOTS);
+    for (size_t i = 0; i < NUM_OPERATIONS; i++)
+    {
+        unsigned int slot = next_random() % NUM_SLOTS;
+        uint64_t r = next_random();
+        ops[i].slot = slot;
+        if (!live[slot])
+        {
+            ops[i].op = (r % 4 == 0) ? OP_CALLOC : OP_MALLOC;
+            ops[i].size = random_size();
+            live[slot] = 1;
+        }
+        else if (r % 3 == 0)
+        {
+            ops[i].op = OP_REALLOC;
+            ops[i].size = random_size();
+        }
+        else
+        {
+            ops[i].op = OP_FREE;
+            live[slot] = 0;
+        }
+    }
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        latencies[op] = map_buffer(NUM_OPERATIONS * sizeof(uint32_t));
+    }
+
+    // Cost of reading the clock twice, subtracted from every sample.
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = now_ns();
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed < overhead)
+        {
+            overhead = elapsed;
+        }
+    }
+
+    struct rusage before, after;
+    int dtlb = open_dtlb_counter();
+    if (dtlb >= 0)
+    {
+        ioctl(dtlb, PERF_EVENT_IOC_RESET, 0);
+        ioctl(dtlb, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    getrusage(RUSAGE_SELF, &before);
+    for (size_t i = 0; i < NUM_OPERATIONS; i++)
+    {
+        operation_t *o = &ops[i];
+        void *ptr = slots[o->slot];
+        uint64_t start = now_ns();
+        switch (o->op)
+        {
+        case OP_MALLOC:
+            ptr = malloc(o->size);
+            break;
+        case OP_CALLOC:
+            ptr = calloc(1, o->size);
+            break;
+        case OP_REALLOC:
+            ptr = realloc(ptr, o->size);
+            break;
+        default:
+            free(ptr);
+            ptr = NULL;
+            break;
+        }
+        uint64_t elapsed = now_ns() - start;
+        elapsed = (elapsed > overhead) ? elapsed - overhead : 0;
+        if ((o->op != OP_FREE) && (ptr == NULL))
+        {
+            fprintf(stderr, "%s(%zu) failed\n", op_names[o->op], o->size);
+            exit(1);
+        }
+        // Touch the block like a program would.
+        if (ptr)
+        {
+            *(volatile char *)ptr = (char)i;
+        }
+        slots[o->slot] = ptr;
+        latencies[o->op][counts[o->op]++] = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsed;
+        totals[o->op] += elapsed;
+    }
+    getrusage(RUSAGE_SELF, &after);
+    result->dtlb_misses = -1;
+    if (dtlb >= 0)
+    {
+        uint64_t misses;
+        ioctl(dtlb, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(dtlb, &misses, sizeof(misses)) == sizeof(misses))
+        {
+            result->dtlb_misses = (long)misses;
+        }
+        close(dtlb);
+    }
+    for (size_t slot = 0; slot < NUM_SLOTS; slot++)
+    {
+        free(slots[slot]);
+    }
+
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        op_stats_t *stats = &result->ops[op];
+        qsort(latencies[op], counts[op], sizeof(uint32_t), compare_u32);
+        stats->count = counts[op];
+        stats->ns_per_op = counts[op] ? (double)totals[op] / counts[op] : 0;
+        stats->p50 = percentile(latencies[op], counts[op], 0.50);
+        stats->p99 = percentile(latencies[op], counts[op], 0.99);
+        stats->p999 = percentile(latencies[op], counts[op], 0.999);
+    }
+    result->peak_rss_kb = after.ru_maxrss;
+    result->minor_faults = after.ru_minflt - before.ru_minflt;
+    result->major_faults = after.ru_majflt - before.ru_majflt;
+}
+
+static void print_json(FILE *out, const bench_result_t *result)
+{
+    fprintf(out, "{\"allocator\":\"%s\"", result->name);
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        const op_stats_t *s = &result->ops[op];
+        fprintf(out, ",\"%s\":{\"count\":%zu,\"ns_per_op\":%.1f,\"p50\":%.0f,\"p99\":%.0f,\"p999\":%.0f}",
+                op_names[op], s->count, s->ns_per_op, s->p50, s->p99, s->p999);
+    }
+    fprintf(out, ",\"peak_rss_kb\":%ld,\"minor_faults\":%ld,\"major_faults\":%ld,\"dtlb_misses\":%ld}\n",
+            result->peak_rss_kb, result->minor_faults, result->major_faults, result->dtlb_misses);
+}
+
+// Reads back a line written by print_json.
+static int parse_json(const char *line, bench_result_t *result)
+{
+    const char *p = strstr(line, "\"allocator\":\"");
+    if ((p == NULL) || (sscanf(p, "\"allocator\":\"%31[^\"]\"", result->name) != 1))
+    {
+        return 0;
+    }
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        char key[32];
+        snprintf(key, sizeof(key), "\"%s\":{", op_names[op]);
+        op_stats_t *s = &result->ops[op];
+        p = strstr(line, key);
+        if ((p == NULL) || (sscanf(p + strlen(key), "\"count\":%zu,\"ns_per_op\":%lf,\"p50\":%lf,\"p99\":%lf,\"p999\":%lf",
+                                   &s->count, &s->ns_per_op, &s->p50, &s->p99, &s->p999) != 5))
+        {
+            return 0;
+        }
+    }
+    p = strstr(line, "\"peak_rss_kb\":");
+    return (p != NULL) && (sscanf(p, "\"peak_rss_kb\":%ld,\"minor_faults\":%ld,\"major_faults\":%ld,\"dtlb_misses\":%ld",
+                                  &result->peak_rss_kb, &result->minor_faults, &result->major_faults, &result->dtlb_misses) == 4);
+}
+
+static void print_table(const bench_result_t *results, int count)
+{
+    printf("%-10s %-8s %10s %10s %8s %8s %8s\n", "allocator", "op", "count", "ns/op", "p50", "p99", "p999");
+    for (int r = 0; r < count; r++)
+    {
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            const op_stats_t *s = &results[r].ops[op];
+            printf("%-10s %-8s %10zu %10.1f %8.0f %8.0f %8.0f\n",
+                   results[r].name, op_names[op], s->count, s->ns_per_op, s->p50, s->p99, s->p999);
+        }
+    }
+    printf("\n%-10s %14s %14s %14s %14s\n", "allocator", "peak RSS (KB)", "minor faults", "major faults", "dTLB misses");
+    for (int r = 0; r < count; r++)
+    {
+        printf("%-10s %14ld %14ld %14ld %14ld\n", results[r].name, results[r].peak_rss_kb, results[r].minor_faults, results[r].major_faults, results[r].dtlb_misses);
+    }
+}
+
+// Runs this program again with --json, with or without a preloaded allocator (on huge pages with thp).
+static int run_child(const char *self, const char *preload, int thp, bench_result_t *result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (preload)
+        {
+            setenv("LD_PRELOAD", preload, 1);
+        }
+        else
+        {
+            unsetenv("LD_PRELOAD");
+        }
+        execl(self, self, "--json", thp ? "--thp" : (char *)NULL, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    char line[1024] = {0};
+    FILE *in = fdopen(fds[0], "r");
+    int ok = (in != NULL) && (fgets(line, sizeof(line), in) != NULL);
+    if (in)
+    {
+        fclose(in);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return ok && WIFEXITED(status) && (WEXITSTATUS(status) == 0) && parse_json(line, result);
+}
+
+// Turns on huge page backing in a preloaded libhmm, which exports hmm_set_huge_pages.
+static int enable_huge_pages(void)
+{
+    void (*set_huge_pages)(int) = (void (*)(int))dlsym(RTLD_DEFAULT, "hmm_set_huge_pages");
+    if (set_huge_pages == NULL)
+    {
+        fprintf(stderr, "--thp needs libhmm preloaded\n");
+        return 0;
+    }
+    set_huge_pages(1);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    bench_result_t results[3];
+    memset(results, 0, sizeof(results));
+    if ((argc == 3) && (strcmp(argv[1], "--compare") == 0))
+    {
+        char self[PATH_MAX], library[PATH_MAX];
+        ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if ((length < 0) || (realpath(argv[2], library) == NULL))
+        {
+            fprintf(stderr, "cannot resolve %s\n", (length < 0) ? "/proc/self/exe" : argv[2]);
+            return 1;
+        }
+        self[length] = '\0';
+        if (!run_child(self, NULL, 0, &results[0]) || !run_child(self, library, 0, &results[1]) || !run_child(self, library, 1, &results[2]))
+        {
+            fprintf(stderr, "benchmark run failed\n");
+            return 1;
+        }
+        strcpy(results[0].name, "glibc");
+        strcpy(results[1].name, "hmm");
+        strcpy(results[2].name, "hmm+thp");
+        print_table(results, 3);
+        printf("\n");
+        for (int r = 0; r < 3; r++)
+        {
+            print_json(stdout, &results[r]);
+        }
+        return 0;
+    }
+    int json = 0;
+    int thp = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        json |= (strcmp(argv[i], "--json") == 0);
+        thp |= (strcmp(argv[i], "--thp") == 0);
+    }
+    if (thp && !enable_huge_pages())
+    {
+        return 1;
+    }
+    const char *preload = getenv("LD_PRELOAD");
+    snprintf(results[0].name, sizeof(results[0].name), "%s%s", (preload && *preload) ? "preload" : "glibc", thp ? "+thp" : "");
+    run_workload(&results[0]);
+    if (json)
+    {
+        print_json(stdout, &results[0]);
+        return 0;
+    }
+    print_table(results, 1);
+    printf("\n");
+    print_json(stdout, &results[0]);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/wait.h>
+
+/*
+ * Same-size churn: thousands of equal-size free blocks pile up in one bin,
+ * then every free coalesces with a neighbour that has to be unlinked from it.
+ *
+ *   ./bench_churn                        run with the allocator in use (glibc, or LD_PRELOAD)
+ *   ./bench_churn --compare LIB.so...    run with glibc, then with each LIB.so preloaded,
+ *                                        e.g. libhmm.so built from this tree and from an older one
+ */
+
+#define NUM_BLOCKS 20000
+
+#define BLOCK_SIZE 32
+
+#define ROUNDS 20
+
+void *blocks[NUM_BLOCKS];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Runs this program again once with glibc, then once per library preloaded.
+static int compare(int count, char **libraries)
+{
+    char self[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (length < 0)
+    {
+        fprintf(stderr, "cannot resolve /proc/self/exe\n");
+        return 1;
+    }
+    self[length] = '\0';
+    for (int i = -1; i < count; i++)
+    {
+        char library[PATH_MAX];
+        if ((i >= 0) && (realpath(libraries[i], library) == NULL))
+        {
+            fprintf(stderr, "cannot resolve %s\n", libraries[i]);
+            return 1;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            if (i < 0)
+            {
+                unsetenv("LD_PRELOAD");
+            }
+            else
+            {
+                setenv("LD_PRELOAD", library, 1);
+            }
+            execl(self, self, (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        if ((pid < 0) || (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+        {
+            fprintf(stderr, "benchmark run failed\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc >= 3) && (strcmp(argv[1], "--compare") == 0))
+    {
+        return compare(argc - 2, argv + 2);
+    }
+    const char *preload = getenv("LD_PRELOAD");
+    double free_ns = 0;
+    size_t frees = 0;
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        for (int i = 0; i < NUM_BLOCKS; i++)
+        {
+            blocks[i] = malloc(BLOCK_SIZE);
+        }
+        // Fill one bin with NUM_BLOCKS / 2 non-adjacent free blocks.
+        for (int i = 0; i < NUM_BLOCKS; i += 2)
+        {
+            free(blocks[i]);
+        }
+        // Each free merges with the neighbour freed above, unlinking it from the bin.
+        double start = now_ns();
+        for (int i = 1; i < NUM_BLOCKS; i += 2)
+        {
+            free(blocks[i]);
+        }
+        free_ns += now_ns() - start;
+        frees += NUM_BLOCKS / 2;
+    }
+    printf("%-32s same-size churn: %d blocks of %d bytes, %.1f ns/free\n", (preload && *preload) ? preload : "glibc", NUM_BLOCKS, BLOCK_SIZE,
+           free_ns / frees);
+    return 0;
+}
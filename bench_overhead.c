@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/wait.h>
+
+/*
+ * Metadata overhead per live allocation: allocates NUM_ALLOCS blocks of one size
+ * on a fresh heap and divides the address span they cover by the block count.
+ *
+ *   ./bench_overhead                        run with the allocator in use (glibc, or LD_PRELOAD)
+ *   ./bench_overhead --compare LIB.so...    run with glibc, then with each LIB.so preloaded,
+ *                                           e.g. libhmm.so built from this tree and from an older one
+ */
+
+#define NUM_ALLOCS 100000
+
+void *blocks[NUM_ALLOCS];
+
+// Runs this program again once with glibc, then once per library preloaded.
+static int compare(int count, char **libraries)
+{
+    char self[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (length < 0)
+    {
+        fprintf(stderr, "cannot resolve /proc/self/exe\n");
+        return 1;
+    }
+    self[length] = '\0';
+    for (int i = -1; i < count; i++)
+    {
+        char library[PATH_MAX];
+        if ((i >= 0) && (realpath(libraries[i], library) == NULL))
+        {
+            fprintf(stderr, "cannot resolve %s\n", libraries[i]);
+            return 1;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            if (i < 0)
+            {
+                unsetenv("LD_PRELOAD");
+            }
+            else
+            {
+                setenv("LD_PRELOAD", library, 1);
+            }
+            execl(self, self, (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        if ((pid < 0) || (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+        {
+            fprintf(stderr, "benchmark run failed\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc >= 3) && (strcmp(argv[1], "--compare") == 0))
+    {
+        return compare(argc - 2, argv + 2);
+    }
+    const char *preload = getenv("LD_PRELOAD");
+    size_t sizes[] = {8, 16, 24, 32, 48, 64, 128};
+    printf("%s\n%10s %12s %12s\n", (preload && *preload) ? preload : "glibc", "size", "footprint", "overhead");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        uintptr_t lowest = UINTPTR_MAX, highest = 0;
+        for (int i = 0; i < NUM_ALLOCS; i++)
+        {
+            blocks[i] = malloc(sizes[s]);
+            if ((uintptr_t)blocks[i] < lowest)
+                lowest = (uintptr_t)blocks[i];
+            if ((uintptr_t)blocks[i] > highest)
+                highest = (uintptr_t)blocks[i];
+        }
+        double footprint = (double)(highest - lowest) / (NUM_ALLOCS - 1);
+        printf("%10zu %12.1f %12.1f\n", sizes[s], footprint, footprint - sizes[s]);
+        for (int i = 0; i < NUM_ALLOCS; i++)
+        {
+            free(blocks[i]);
+        }
+    }
+    return 0;
+}
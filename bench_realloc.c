@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Realloc throughput versus block size: each round fills a block of one size,
+ * then times a single realloc growing it by 10%. A copying realloc costs time
+ * proportional to the block size; a remapping one stays nearly flat.
+ */
+
+#define ROUNDS 5
+
+#define MB (1024 * 1024)
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizes[] = {1 * MB, 4 * MB, 16 * MB, 64 * MB, 256 * MB, 1024 * MB};
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    // Pass a size in MB to stop at a smaller block on machines with little memory.
+    size_t limit = (argc > 1) ? strtoul(argv[1], NULL, 10) * MB : sizes[count - 1];
+    printf("%12s %14s %14s\n", "size (MB)", "us/realloc", "GB/s");
+    for (size_t s = 0; s < count && sizes[s] <= limit; s++)
+    {
+        double total_ns = 0;
+        for (int r = 0; r < ROUNDS; r++)
+        {
+            char *block = malloc(sizes[s]);
+            if (block == NULL)
+            {
+                printf("malloc(%zu) failed\n", sizes[s]);
+                return 1;
+            }
+            memset(block, r, sizes[s]);
+            double start = now_ns();
+            char *grown = realloc(block, sizes[s] + sizes[s] / 10);
+            total_ns += now_ns() - start;
+            if ((grown == NULL) || (grown[sizes[s] - 1] != (char)r))
+            {
+                printf("realloc(%zu) failed\n", sizes[s] + sizes[s] / 10);
+                return 1;
+            }
+            free(grown);
+        }
+        double ns = total_ns / ROUNDS;
+        printf("%12zu %14.1f %14.1f\n", sizes[s] / MB, ns / 1e3, sizes[s] / ns);
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "HMM.h"
+
+/*
+ * Sized versus unsized free: allocates a batch of same-size blocks, then frees
+ * them in shuffled order, once with free and once with free_sized. Shuffling
+ * spreads the frees across many slabs, so reading each block's metadata misses
+ * the cache the way it does in a real heap. Most of these frees overflow the
+ * per-thread cache, whose flush reads the metadata either way, so a second pass
+ * times malloc/free pairs of a few blocks that the cache absorbs.
+ */
+
+#define NUM_BLOCKS 100000
+
+#define ROUNDS 10
+
+#define HOT_BLOCKS 16
+
+#define HOT_ITERATIONS 50000
+
+void *blocks[NUM_BLOCKS];
+
+size_t order[NUM_BLOCKS];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_frees(size_t size, int sized)
+{
+    for (size_t i = 0; i < NUM_BLOCKS; i++)
+    {
+        blocks[i] = malloc(size);
+    }
+    double start = now_ns();
+    if (sized)
+    {
+        for (size_t i = 0; i < NUM_BLOCKS; i++)
+        {
+            free_sized(blocks[order[i]], size);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < NUM_BLOCKS; i++)
+        {
+            free(blocks[order[i]]);
+        }
+    }
+    return now_ns() - start;
+}
+
+static double time_hot(size_t size, int sized)
+{
+    void *hot[HOT_BLOCKS];
+    double start = now_ns();
+    for (int it = 0; it < HOT_ITERATIONS; it++)
+    {
+        for (int i = 0; i < HOT_BLOCKS; i++)
+        {
+            hot[i] = malloc(size);
+        }
+        for (int i = 0; i < HOT_BLOCKS; i++)
+        {
+            if (sized)
+            {
+                free_sized(hot[i], size);
+            }
+            else
+            {
+                free(hot[i]);
+            }
+        }
+    }
+    return now_ns() - start;
+}
+
+int main()
+{
+    size_t sizes[] = {16, 64, 256, 1024, 4096};
+    srand(1);
+    for (size_t i = 0; i < NUM_BLOCKS; i++)
+    {
+        order[i] = i;
+    }
+    for (size_t i = NUM_BLOCKS - 1; i > 0; i--)
+    {
+        size_t j = rand() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    printf("%10s %14s %14s\n", "size", "free ns", "free_sized ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        double unsized_ns = 0;
+        double sized_ns = 0;
+        // Alternate the two so that neither always runs on a warmer heap.
+        for (int r = 0; r < ROUNDS; r++)
+        {
+            unsized_ns += time_frees(sizes[s], 0);
+            sized_ns += time_frees(sizes[s], 1);
+        }
+        printf("%10zu %14.1f %14.1f\n", sizes[s], unsized_ns / ROUNDS / NUM_BLOCKS, sized_ns / ROUNDS / NUM_BLOCKS);
+    }
+    printf("\n%10s %14s %14s  (malloc + free pairs, cache-resident)\n", "size", "free ns", "free_sized ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        double unsized_ns = 0;
+        double sized_ns = 0;
+        for (int r = 0; r < ROUNDS; r++)
+        {
+            unsized_ns += time_hot(sizes[s], 0);
+            sized_ns += time_hot(sizes[s], 1);
+        }
+        printf("%10zu %14.1f %14.1f\n", sizes[s], unsized_ns / ROUNDS / HOT_ITERATIONS / HOT_BLOCKS, sized_ns / ROUNDS / HOT_ITERATIONS / HOT_BLOCKS);
+    }
+    return 0;
+}
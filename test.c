@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include "HMM.h"
 
 #define NUM_OPERATIONS 100000
 
@@ -66,9 +72,433 @@ void perform_random_operations()
     }
 }
 
+int perform_aligned_operations()
+{
+    int failures = 0;
+
+    for (size_t alignment = 16; alignment <= ((size_t)32 << 20); alignment <<= 1)
+    {
+        size_t size = rand() % MAX_SIZE + 1;
+        void *ptr = aligned_alloc(alignment, size);
+        if ((ptr == NULL) || ((uintptr_t)ptr % alignment != 0) || (malloc_usable_size(ptr) < size))
+        {
+            printf("aligned_alloc(%zu, %zu) returned %p\n", alignment, size, ptr);
+            failures++;
+            continue;
+        }
+        memset(ptr, 0xAB, size);
+        free(ptr);
+    }
+
+    // Alignments the allocator cannot serve are rejected, not misplaced.
+    void *ptr = aligned_alloc((size_t)64 << 20, 100);
+    if ((ptr != NULL) || (errno != EINVAL))
+    {
+        printf("aligned_alloc(64 MB, 100) returned %p\n", ptr);
+        free(ptr);
+        failures++;
+    }
+    return failures;
+}
+
+int perform_calloc_overflow_checks()
+{
+    int failures = 0;
+    // volatile keeps the compiler from folding the calls.
+    volatile size_t huge = SIZE_MAX;
+    size_t counts[][2] = {{1, huge}, {1, huge - 8}, {2, huge / 2 + 1}, {huge / 16 + 1, 16}, {1, (size_t)PTRDIFF_MAX + 1}};
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        errno = 0;
+        void *ptr = calloc(counts[i][0], counts[i][1]);
+        if ((ptr != NULL) || (errno != ENOMEM))
+        {
+            printf("calloc(%zu, %zu) returned %p, errno %d\n", counts[i][0], counts[i][1], ptr, errno);
+            free(ptr);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+void *fill_slabs(void *arg)
+{
+    // Enough 64-byte objects to fill more than one 64 MB slab segment.
+    size_t count = 1500000;
+    void **ptrs = malloc(count * sizeof(void *));
+    hmm_stats_t stats;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ptrs[i] = malloc(64);
+        memset(ptrs[i], 0xab, 64);
+    }
+    hmm_stats(&stats);
+    *(size_t *)arg = stats.bytes_mapped;
+    for (size_t i = 0; i < count; i++)
+    {
+        free(ptrs[i]);
+    }
+    free(ptrs);
+    return NULL;
+}
+
+int perform_slab_release_checks()
+{
+    int failures = 0;
+    size_t peak = 0;
+    hmm_stats_t before, stats;
+    pthread_t thread;
+
+    malloc_trim(0);
+    hmm_stats(&before);
+    // The thread's cache is flushed when it exits, leaving every slab it filled empty.
+    pthread_create(&thread, NULL, fill_slabs, &peak);
+    pthread_join(thread, NULL);
+    malloc_trim(0);
+    hmm_stats(&stats);
+    // Segments holding only the thread's objects go away; one shared with older blocks is only purged.
+    if ((peak < before.bytes_mapped + 96 * 1024 * 1024) || (stats.bytes_mapped > before.bytes_mapped + 64 * 1024 * 1024))
+    {
+        printf("slab memory kept after malloc_trim: %zu bytes mapped (%zu before, %zu at peak)\n", stats.bytes_mapped, before.bytes_mapped, peak);
+        failures++;
+    }
+    // Purged slabs must come back usable.
+    for (size_t i = 0; i < 1000; i++)
+    {
+        unsigned char *ptr = malloc(64);
+        memset(ptr, 0xcd, 64);
+        free(ptr);
+    }
+    return failures;
+}
+
+void *fill_chunks(void *arg)
+{
+    size_t count = 1000;
+    void *ptrs[1000];
+
+    // Keeps the segment mapped and the chunk freed below from being its first one.
+    *(void **)arg = malloc(4000);
+    // 4 MB of blocks below TREE_MIN_SIZE, merged once freed into a chunk ending the segment, below the trim threshold.
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t size = (i % 4) ? 4000 : 64;
+        ptrs[i] = malloc(size);
+        memset(ptrs[i], 0xab, size);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        free(ptrs[i]);
+    }
+    return NULL;
+}
+
+int perform_trim_checks()
+{
+    int failures = 0;
+    void *keep = NULL;
+    hmm_stats_t before, stats;
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, fill_chunks, &keep);
+    pthread_join(thread, NULL);
+    // Small blocks freed by this thread stay in its cache until malloc_trim flushes it.
+    for (size_t i = 0; i < 100; i++)
+    {
+        free(malloc(64 + (i % 8) * 16));
+    }
+    hmm_stats(&before);
+    int released = malloc_trim(0);
+    hmm_stats(&stats);
+    if (!released || (stats.bytes_releasable != 0) || (stats.bytes_mapped + 1024 * 1024 > before.bytes_mapped))
+    {
+        printf("malloc_trim(0) returned %d: %zu bytes releasable (%zu before), %zu bytes mapped (%zu before)\n", released, stats.bytes_releasable,
+               before.bytes_releasable, stats.bytes_mapped, before.bytes_mapped);
+        failures++;
+    }
+    free(keep);
+    return failures;
+}
+
+void *fill_remote(void *arg)
+{
+    void **ptrs = arg;
+
+    for (size_t i = 0; i < 3000; i++)
+    {
+        size_t size = (i % 3 == 0) ? 48 : (i % 3 == 1) ? 600 : 5000;
+        ptrs[i] = malloc(size);
+        memset(ptrs[i], (int)(i & 0xff), size);
+    }
+    return NULL;
+}
+
+int perform_remote_free_checks()
+{
+    int failures = 0;
+    static void *ptrs[3000];
+    hmm_stats_t before, stats;
+    pthread_t thread;
+
+    malloc_trim(0);
+    hmm_stats(&before);
+    // Blocks of the thread's arena, freed here through its remote-free stack.
+    pthread_create(&thread, NULL, fill_remote, ptrs);
+    pthread_join(thread, NULL);
+    for (size_t i = 0; i < 3000; i++)
+    {
+        size_t size = (i % 3 == 0) ? 48 : (i % 3 == 1) ? 600 : 5000;
+        for (size_t j = 0; j < size; j++)
+        {
+            if (((unsigned char *)ptrs[i])[j] != (i & 0xff))
+            {
+                printf("block %zu of another thread corrupted at byte %zu\n", i, j);
+                failures++;
+                break;
+            }
+        }
+    }
+    // A block whose data looks like the key of a pending remote free must still be freed.
+    free(ptrs[2]);
+    void *key = ((void *volatile *)ptrs[2])[1];
+    ((void **)ptrs[5])[1] = key;
+    free(ptrs[5]);
+    for (size_t i = 0; i < 3000; i++)
+    {
+        if ((i != 2) && (i != 5))
+        {
+            free(ptrs[i]);
+        }
+    }
+    malloc_trim(0);
+    hmm_stats(&stats);
+    if (stats.bytes_in_use != before.bytes_in_use)
+    {
+        printf("remote frees left %zu bytes in use (%zu before)\n", stats.bytes_in_use, before.bytes_in_use);
+        failures++;
+    }
+    return failures;
+}
+
+#define BATCH_SIZE 64
+
+void *fill_batch(void *arg)
+{
+    if (hmm_malloc_batch(5000, BATCH_SIZE, arg) != BATCH_SIZE)
+    {
+        return arg;
+    }
+    return NULL;
+}
+
+int check_batch(void **ptrs, size_t n, size_t size, int seed)
+{
+    int failures = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if ((ptrs[i] == NULL) || ((uintptr_t)ptrs[i] % 16 != 0) || (malloc_usable_size(ptrs[i]) < size))
+        {
+            printf("batch block %zu of size %zu is %p\n", i, size, ptrs[i]);
+            return 1;
+        }
+        memset(ptrs[i], (seed + (int)i) & 0xff, size);
+    }
+    // Overlapping blocks would overwrite each other's pattern.
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char *bytes = ptrs[i];
+        if ((bytes[0] != ((seed + i) & 0xff)) || (bytes[size - 1] != ((seed + i) & 0xff)))
+        {
+            printf("batch block %zu of size %zu overlaps another\n", i, size);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int perform_batch_checks()
+{
+    int failures = 0;
+    // Slab objects, cached and uncached chunks, a tree chunk and large-block mappings.
+    size_t sizes[] = {24, 200, 700, 5000, 100000, 2 * 1024 * 1024};
+    void *ptrs[BATCH_SIZE];
+    void *others[BATCH_SIZE];
+    void *mixed[4 * BATCH_SIZE + 8];
+    hmm_stats_t before, stats;
+    pthread_t thread;
+    void *result;
+
+    malloc_trim(0);
+    hmm_stats(&before);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t n = (sizes[s] > 1024 * 1024) ? 4 : BATCH_SIZE;
+        if (hmm_malloc_batch(sizes[s], n, ptrs) != n)
+        {
+            printf("hmm_malloc_batch(%zu, %zu) came up short\n", sizes[s], n);
+            failures++;
+            continue;
+        }
+        failures += check_batch(ptrs, n, sizes[s], (int)s);
+        // Free every other block: the live ones must keep their contents, then the
+        // freed ones must come back usable.
+        for (size_t i = 0; i < n; i += 2)
+        {
+            mixed[i / 2] = ptrs[i];
+            ptrs[i] = NULL;
+        }
+        hmm_free_batch(mixed, n / 2);
+        for (size_t i = 1; i < n; i += 2)
+        {
+            unsigned char *bytes = ptrs[i];
+            if ((bytes[0] != ((s + i) & 0xff)) || (bytes[sizes[s] - 1] != ((s + i) & 0xff)))
+            {
+                printf("hmm_free_batch corrupted a live block of size %zu\n", sizes[s]);
+                failures++;
+            }
+        }
+        if (hmm_malloc_batch(sizes[s], n / 2, mixed) != n / 2)
+        {
+            printf("hmm_malloc_batch(%zu, %zu) came up short after hmm_free_batch\n", sizes[s], n / 2);
+            failures++;
+            continue;
+        }
+        for (size_t i = 0; i < n; i += 2)
+        {
+            ptrs[i] = mixed[i / 2];
+        }
+        failures += check_batch(ptrs, n, sizes[s], (int)s + 1);
+        hmm_free_batch(ptrs, n);
+    }
+    // Blocks of two arenas, neighbours merged in the batch, with NULL entries and duplicates.
+    pthread_create(&thread, NULL, fill_batch, others);
+    pthread_join(thread, &result);
+    if ((result != NULL) || (hmm_malloc_batch(5000, BATCH_SIZE, ptrs) != BATCH_SIZE))
+    {
+        printf("hmm_malloc_batch(5000, %d) came up short\n", BATCH_SIZE);
+        return failures + 1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < BATCH_SIZE; i++)
+    {
+        mixed[count++] = ptrs[i];
+        mixed[count++] = others[BATCH_SIZE - 1 - i];
+        if (i % 8 == 0)
+        {
+            mixed[count++] = NULL;
+            mixed[count++] = ptrs[i];
+        }
+    }
+    hmm_free_batch(mixed, count);
+    malloc_trim(0);
+    hmm_stats(&stats);
+    if ((stats.bytes_in_use != before.bytes_in_use) || (stats.mmap_chunks != before.mmap_chunks))
+    {
+        printf("batches left %zu bytes in use and %zu mappings (%zu and %zu before)\n", stats.bytes_in_use, stats.mmap_chunks, before.bytes_in_use,
+               before.mmap_chunks);
+        failures++;
+    }
+    return failures;
+}
+
+#define TREE_BLOCKS 32
+
+int perform_tree_checks()
+{
+    int failures = 0;
+    void *blocks[TREE_BLOCKS];
+    void *separators[TREE_BLOCKS];
+    size_t sizes[TREE_BLOCKS];
+
+    // Best fit: free blocks of 64 KB and more, kept apart by live separators, then
+    // request a size between theirs. No worse-fitting block of the set may be taken.
+    for (int round = 0; round < 50; round++)
+    {
+        for (size_t i = 0; i < TREE_BLOCKS; i++)
+        {
+            // Some sizes repeat, so equal-size nodes are exercised too.
+            sizes[i] = 64 * 1024 + (size_t)(rand() % 24) * 16 * 1024 + (size_t)(rand() % 64) * 16;
+            blocks[i] = malloc(sizes[i]);
+            separators[i] = malloc(64 * 1024);
+            sizes[i] = malloc_usable_size(blocks[i]);
+        }
+        for (size_t i = 0; i < TREE_BLOCKS; i++)
+        {
+            free(blocks[i]);
+        }
+        size_t request = sizes[rand() % TREE_BLOCKS] - (size_t)(rand() % 8) * 16;
+        size_t best = (size_t)-1;
+        for (size_t i = 0; i < TREE_BLOCKS; i++)
+        {
+            if ((sizes[i] >= request) && (sizes[i] < best))
+            {
+                best = sizes[i];
+            }
+        }
+        void *ptr = malloc(request);
+        for (size_t i = 0; i < TREE_BLOCKS; i++)
+        {
+            if ((ptr == blocks[i]) && (sizes[i] != best))
+            {
+                printf("malloc(%zu) took a free block of %zu bytes over one of %zu\n", request, sizes[i], best);
+                failures++;
+            }
+        }
+        free(ptr);
+        for (size_t i = 0; i < TREE_BLOCKS; i++)
+        {
+            free(separators[i]);
+        }
+    }
+    // Churn through the tree, checking that no block is handed out twice.
+    for (size_t i = 0; i < TREE_BLOCKS; i++)
+    {
+        blocks[i] = NULL;
+    }
+    for (int op = 0; op < 20000; op++)
+    {
+        size_t i = (size_t)rand() % TREE_BLOCKS;
+        if (blocks[i])
+        {
+            unsigned char *bytes = blocks[i];
+            if ((bytes[0] != (i & 0xff)) || (bytes[sizes[i] - 1] != (i & 0xff)))
+            {
+                printf("tree block %zu of %zu bytes was overwritten\n", i, sizes[i]);
+                failures++;
+            }
+            free(blocks[i]);
+            blocks[i] = NULL;
+        }
+        else
+        {
+            sizes[i] = 64 * 1024 + (size_t)(rand() % (448 * 1024));
+            blocks[i] = malloc(sizes[i]);
+            memset(blocks[i], (int)(i & 0xff), sizes[i]);
+        }
+    }
+    for (size_t i = 0; i < TREE_BLOCKS; i++)
+    {
+        free(blocks[i]);
+    }
+    return failures;
+}
+
 int main()
 {
+    int failures = 0;
+
     perform_random_operations();
 
-    return 0;
+    failures += perform_aligned_operations();
+    failures += perform_calloc_overflow_checks();
+    failures += perform_slab_release_checks();
+    failures += perform_trim_checks();
+    failures += perform_remote_free_checks();
+    failures += perform_batch_checks();
+    failures += perform_tree_checks();
+
+    return (failures != 0);
 }